@@ -0,0 +1,68 @@
+// Time base: the TSC is calibrated against channel 2 of the PIT
+// at boot, and then times everything else, including the LAPIC
+// timer. The TSC is assumed to tick at a constant rate and in
+// step on all cpus, as it does on modern processors and QEMU.
+#include <arch/i386/inc.h>
+
+#define PIT_HZ      1193182     // Input clock of the PIT
+#define PIT_CH2     0x42
+#define PIT_CMD     0x43
+#define PIT_GATE    0x61        // Gate of channel 2 in bit 0, its output in bit 5
+#define CAL_RUNS    3           // The shortest run is the least disturbed
+
+uint32_t tsc_khz;               // TSC cycles per ms, 0 until clock_init
+static uint64_t tsc_boot;
+
+// TSC cycles while channel 2 of the PIT counts down CAL_MS
+static uint64_t
+pit_measure()
+{
+    uint32_t latch = PIT_HZ * CAL_MS / 1000;
+    outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);     // Gate on, speaker off
+    outb(PIT_CMD, 0xB0);        // Channel 2, low then high byte, mode 0
+    outb(PIT_CH2, latch & 0xFF);
+    outb(PIT_CH2, latch >> 8);
+    uint64_t t = rdtsc();
+    while (!(inb(PIT_GATE) & 0x20))
+        ;
+    return rdtsc() - t;
+}
+
+void
+clock_init()
+{
+    uint64_t best = ~0ULL;
+    tsc_boot = rdtsc();
+    for (int i = 0; i < CAL_RUNS; i ++)
+        best = MIN(best, pit_measure());
+    tsc_khz = divl(best, CAL_MS);
+    cprintf("clock: tsc %d kHz\n", tsc_khz);
+}
+
+// Nanoseconds since clock_init, never going back
+uint64_t
+clock_ns()
+{
+    uint64_t c = rdtsc() - tsc_boot;
+    uint32_t ms = divl(c, tsc_khz);
+    uint32_t rem = c - (uint64_t)ms * tsc_khz;
+    return (uint64_t)ms * 1000000 + divl((uint64_t)rem * 1000000, tsc_khz);
+}
+
+// Milliseconds since clock_init
+uint32_t
+clock_ms()
+{
+    return divl(rdtsc() - tsc_boot, tsc_khz);
+}
+
+// Spin for a given number of microseconds.
+void
+micro_delay(int us)
+{
+    if (!tsc_khz)
+        panic("micro_delay: clock not calibrated\n");
+    uint64_t end = rdtsc() + divl((uint64_t)us * tsc_khz, 1000);
+    while (rdtsc() < end)
+        pause();
+}
@@ -115,6 +115,7 @@ consputc(int c)
 
 void
 cons_init() {
+    lock_init(&console_lock, "console");
     //cga_init();
     uart_init();
     if (!uart)
@@ -1,4 +1,5 @@
 #include <arch/i386/inc.h>
+#include <traps.h>
 
 struct cpu cpus[NCPU];
 int ncpu;
@@ -11,8 +12,10 @@ cpuidx()
     return thiscpu() - cpus;
 }
 
+// Find this cpu by its local APIC ID, which is slow.
+// Only used before seg_init sets up thiscpu().
 struct cpu *
-thiscpu() 
+cpu_probe() 
 {
     int apicid = lapicid();
     for (struct cpu *c = cpus; c < cpus + ncpu; c ++)
@@ -20,3 +23,65 @@ thiscpu()
             return c;
     panic("unknown apicid");
 }
+
+// pushcli/popcli are like cli/sti except that they are matched:
+// it takes two popcli to undo two pushcli. Also, if interrupts
+// are off, then pushcli, popcli leaves them off.
+void
+pushcli()
+{
+    uint32_t eflags = read_eflags();
+    cli();
+    struct cpu *c = thiscpu();
+    if (c->ncli++ == 0) {
+        c->intena = eflags & FL_IF;
+        c->clistart = rdtsc();
+    }
+}
+
+void
+popcli()
+{
+    if (read_eflags() & FL_IF)
+        panic("popcli: interruptible\n");
+    struct cpu *c = thiscpu();
+    if (--c->ncli < 0)
+        panic("popcli: unbalanced\n");
+    if (!c->ncli && c->intena) {
+        c->climax = MAX(c->climax, (uint32_t)(rdtsc() - c->clistart));
+        sti();
+    }
+}
+
+// Print the longest time each cpu kept interrupts off
+// in pushcli sections entered with interrupts on,
+// and the timer and reschedule interrupts it took.
+void
+intr_stat()
+{
+    for (int i = 0; i < ncpu; i ++) {
+        cprintf("intr: cpu %d: interrupts off for up to %d cycles\n", i, cpus[i].climax);
+        cprintf("intr: cpu %d: %d timer, %d resched\n", i, cpus[i].ntimer, cpus[i].nresched);
+    }
+}
+
+// Wait for an interrupt with interrupts off, which
+// are turned on only once hlt is executing.
+void
+cpu_halt()
+{
+    asm volatile("sti; hlt");
+}
+
+// Wake cpu i if it is halted
+void
+cpu_kick(int i)
+{
+    lapic_ipi(cpus[i].apicid, T_IRQ0 + IRQ_RESCHED);
+}
+
+struct magazine *
+cpu_mag(int i)
+{
+    return &cpus[i].mag;
+}
@@ -11,39 +11,59 @@
 
 #include <kern/inc.h>
 
-// Maximum number of CPUs
-#define NCPU  8
-
 // Values of status in struct cpu
 enum { CPU_UNUSED = 0, CPU_STARTED, CPU_HALTED,};
 
-// Per-CPU state
+// Per-CPU state, a cache line apart from each other
 struct cpu {
+	struct cpu *self;               // %gs:0, see thiscpu()
 	uint8_t apicid;                 // Local APIC ID
 	volatile unsigned status;       // The status of the CPU
 	struct proc scheduler;         // swtchp() here to enter scheduler
 	struct taskstate ts;            // Used by x86 to find stack for interrupt
 	struct segdesc gdt[NSEGS];      // x86 global descriptor table
 	struct proc *proc;              // The process running on this cpu or null
-	//int32_t ncli;                   // Depth of pushcli nesting
-	//int32_t intena;                 // Were interrupts enabled before pushcli?
-};
+	struct proc *prev;              // The process swtch left, see swtch_done
+	struct magazine mag;            // Free pages cached by this cpu
+	int32_t ncli;                   // Depth of pushcli nesting
+	int32_t intena;                 // Were interrupts enabled before pushcli?
+	uint64_t clistart;              // When the outermost pushcli turned them off
+	uint32_t climax;                // Longest such section in cycles
+	uint32_t ntimer;                // Timer interrupts taken
+	uint32_t nresched;              // Reschedule IPIs taken
+} __attribute__((aligned(64)));
 
 // cpu.c
 extern struct cpu cpus[NCPU];
-extern int ncpu;                    // Total number of CPUs in the system
 extern struct cpu *bootcpu;         // The boot-strap processor (BSP)
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
-int cpuidx();
-struct cpu *thiscpu();
+struct cpu *cpu_probe();
+
+// The segment of %gs starts at thiscpu()->self,
+// set up by seg_init and reloaded on each trap.
+static inline struct cpu *
+thiscpu()
+{
+    struct cpu *c;
+    asm volatile("movl %%gs:0, %0" : "=r" (c));
+    return c;
+}
 
 // lapic.c
 extern volatile uint32_t *lapic;    // Physical MMIO address of the local APIC
 void    lapic_init();
 void    lapic_startap(uint8_t apicid, uint32_t addr);
 void    lapic_eoi();
+void    lapic_ipi(int apicid, int vector);
+void    lapic_timer(int ticks);
 int     lapicid();
 
+// clock.c
+#define CAL_MS 10                   // Calibration time
+extern uint32_t tsc_khz;            // TSC cycles per ms
+void    clock_init();
+void    micro_delay(int us);
+
 // ioapic.c
 void    ioapic_init();
 void    ioapic_enable(int, int);
@@ -62,11 +82,30 @@ void    idt_init();
 extern pde_t entry_pgdir[NPDENTRIES];
 void seg_init();
 void tss_init();
+void pgcache_init();
 void test_pgdir(pde_t *pgdir);
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int32_t alloc);
+void vm_map(struct vm *vm, uint32_t va, uint32_t pa, int perm);
+int  vm_alloc_contig(struct vm *vm, uint32_t va, int n);
+int  vm_copyout(struct vm *vm, uint32_t va, void *src, uint32_t len);
 pde_t *vm_fork(pde_t *pgdir);
 
 int uvm_check(struct vm *vm, char *s, uint32_t len);
+int uvm_copyout(struct vm *vm, uint32_t va, void *src, uint32_t len);
+
+// swap.c
+void swap_init();
+int  swap_in(struct vm *vm, uint32_t va);
+void swap_free(pte_t pte);
+void swap_stat();
+
+// multiboot.c
+#define NMEMRANGE 16
+struct memrange {
+    uint32_t start, end;            // Physical [start, end)
+};
+extern struct memrange memranges[NMEMRANGE];
+extern int nmemrange;
 
 // mm.c
 extern void *PHYSTOP; // maximum physical memory address(pa)
@@ -78,9 +117,9 @@ void sched_init();
 int fork();
 
 // user.c
-extern struct proc *utable[NUSERS];
+extern int utable[NUSERS];
 void user_init();
-void user_intr();
+void user_intr(int pid);
 
 // ipc.c
 void ipc_init(struct proc *);
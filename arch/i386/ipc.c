@@ -6,7 +6,9 @@ ipc_init(struct proc *p) {
     pte_t *pte = pgdir_walk((pde_t *)(p->vm), (void *)USTKTOP, 0);
     assert(*pte & PTE_P);
     p->mailbox = P2V(PTE_ADDR(*pte));
-    assert(sizeof(struct mailbox) <= PGSIZE && sizeof(p->mailbox->content) >= sizeof(utable));
-    memmove(p->mailbox->content, utable, sizeof(utable));
+    assert(sizeof(struct mailbox) <= PGSIZE && sizeof(p->mailbox->content) >= NUSERS * sizeof(int));
+    // Pids of the servers, for USER_PID
+    for (int i = 0; i < NUSERS; i ++)
+        ((int *)p->mailbox->content)[i] = utable[i];
 }
 
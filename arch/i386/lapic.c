@@ -28,6 +28,7 @@
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
   #define X1         0x0000000B   // divide counts by 1
   #define PERIODIC   0x00020000   // Periodic
+  #define ONESHOT    0x00000000   // One-shot
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
 #define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
@@ -38,6 +39,7 @@
 #define TDCR    (0x03E0/4)   // Timer Divide Configuration
 
 volatile uint32_t *lapic;  // Initialized in acpi.c
+static uint32_t lapic_khz; // Timer counts per ms
 
 static void
 lapicw(int index, int value)
@@ -58,13 +60,22 @@ lapic_init(void)
     // Enable local APIC; set spurious interrupt vector.
     lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-    // The timer repeatedly counts down at bus frequency
-    // from lapic[TICR] and then issues an interrupt.
-    // If xv6 cared more about precise timekeeping,
-    // TICR would be calibrated using an external time source.
+    // The timer counts down once at bus frequency from
+    // lapic[TICR] and then issues an interrupt. It is armed
+    // by lapic_timer only when there is a deadline, so idle
+    // cpus take no timer interrupts.
+    // All cpus share the bus clock, so the boot cpu times it
+    // against the TSC for all.
     lapicw(TDCR, X1);
-    lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-    lapicw(TICR, 10000000);
+    if (!lapic_khz) {
+        lapicw(TIMER, MASKED | ONESHOT);
+        lapicw(TICR, 0xFFFFFFFF);
+        micro_delay(CAL_MS * 1000);
+        lapic_khz = (0xFFFFFFFF - lapic[TCCR]) / CAL_MS;
+        cprintf("lapic: timer %d kHz\n", lapic_khz);
+    }
+    lapicw(TIMER, ONESHOT | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, 0);
 
     // Disable logical interrupt lines.
     lapicw(LINT0, MASKED);
@@ -111,15 +122,23 @@ lapic_eoi(void)
         lapicw(EOI, 0);
 }
 
-// Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
+// Interrupt this cpu once after ticks timer ticks,
+// or never if ticks is 0.
 void
-micro_delay(int us)
+lapic_timer(int ticks)
 {
-    for (int i = 0; i < us; i ++) {
-        int x = 10000;
-        while(x--);
-    }
+    uint32_t per = TICK_MS * lapic_khz;
+    lapicw(TICR, MIN((uint32_t)ticks, 0xFFFFFFFF / per) * per);
+}
+
+// Send interrupt vector to the cpu of apicid.
+void
+lapic_ipi(int apicid, int vector)
+{
+    lapicw(ICRHI, apicid << 24);
+    lapicw(ICRLO, FIXED | ASSERT | vector);
+    while(lapic[ICRLO] & DELIVS)
+        ;
 }
 
 #define CMOS_PORT    0x70
@@ -148,7 +167,7 @@ lapic_startap(uint8_t apicid, uint32_t addr)
     lapicw(ICRLO, INIT | LEVEL | ASSERT);
     micro_delay(200);
     lapicw(ICRLO, INIT | LEVEL);
-    micro_delay(100);    // should be 10ms, but too slow in Bochs!
+    micro_delay(10000);
 
     // Send startup IPI (twice!) to enter code.
     // Regular hardware is supposed to only accept a STARTUP
@@ -7,10 +7,14 @@ static int finish;
 
 void kernel_main() {
 
+    seg_init(); // For thiscpu() until acpi_init
     cons_init();
     test_pgdir(entry_pgdir);
 
     mm_init();
+    kmem_cache_init();
+    pgcache_init();
+    swap_init();
     acpi_init();
     trap_init();
 
@@ -18,12 +22,14 @@ void kernel_main() {
     idt_init(); // IDT
 
     pic_init();
+    clock_init();
     lapic_init();
     ioapic_init();
 
     ioapic_enable(IRQ_KBD, 0);
 
     proc_init();
+    timer_wheel_init();
 
     boot_aps();
     sched_init();
@@ -1,13 +1,34 @@
-#include <kern/inc.h>
-#include <arch/i386/memlayout.h>
+#include <arch/i386/inc.h>
 
 // Phsical memory top(pa) and kernel end(va)
 void *PHYSTOP, *kend;
 
+// Physical memory above this is not mapped at KERNBASE
+#define KMAPTOP (DEVSPACE - KERNBASE)
+
+// Give the available memory reported by the boot loader to kern/mm.c.
+// Memory below the kernel is left to BIOS data and AP boot code.
 void
 mm_init() 
 {
+    uint32_t hi = 0;
+    for (int i = 0; i < nmemrange; i ++) {
+        struct memrange *r = &memranges[i];
+        cprintf("memrange: 0x%x ~ 0x%x\n", r->start, r->end);
+        r->start = MAX(ROUNDUP(r->start, PGSIZE), V2P(kend));
+        r->end = MIN(ROUNDDOWN(r->end, PGSIZE), KMAPTOP);
+        if (r->start < r->end)
+            hi = MAX(hi, r->end);
+    }
+    PHYSTOP = (void *)hi;
     cprintf("PHYSTOP: 0x%x\n", PHYSTOP);
     cprintf("kend: 0x%x\n", kend);
-    free_range(kend, P2V(PHYSTOP));
+
+    kmem_init(P2V(0), P2V(PHYSTOP));
+    for (int i = 0; i < nmemrange; i ++) 
+        if (memranges[i].start < memranges[i].end)
+            free_range(P2V(memranges[i].start), P2V(memranges[i].end));
+    // free_range places it in the first range large enough
+    if (!pages)
+        panic("mm_init: no memory range holds %d page descriptors\n", (uint32_t)PHYSTOP / PGSIZE);
 }
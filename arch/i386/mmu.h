@@ -45,9 +45,10 @@
 #define SEG_UCODE 5  // user code
 #define SEG_UDATA 6  // user data+stack
 #define SEG_TSS   7  // this process's task state
+#define SEG_KCPU  8  // this cpu's struct cpu, loaded in %gs
 
 // cpu->gdt[NSEGS] holds the above segments.
-#define NSEGS     8
+#define NSEGS     9
 
 // application segment type bits
 #define STA_X       0x8     // executable segment
@@ -122,8 +123,14 @@ struct segdesc {
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
 #define PTE_PS          0x080   // Page Size
 
+// A not present PTE with PTE_SWAP set holds the
+// physical address of a compressed page, see swap.c
+#define PTE_SWAP        0x002
+#define SWAP_ADDR(pte)  ((uint)(pte) & ~0x3)
+
 #ifndef __ASSEMBLER__
 // A virtual address 'la' has a three-part structure as follows:
 //
@@ -10,8 +10,8 @@ struct {
 } multiboot_header 
 __attribute__((section(".multiboot"))) __attribute__((aligned(4))) = {
     MULTIBOOT_HEADER_MAGIC,
-    MULTIBOOT_INFO_MEMORY,
-    -(MULTIBOOT_HEADER_MAGIC + MULTIBOOT_INFO_MEMORY), 
+    MULTIBOOT_PAGE_ALIGN | MULTIBOOT_MEMORY_INFO,
+    -(MULTIBOOT_HEADER_MAGIC + (MULTIBOOT_PAGE_ALIGN | MULTIBOOT_MEMORY_INFO)), 
 };
 
 struct {
@@ -32,25 +32,65 @@ __attribute__((section(".multiboot2"))) __attribute__((aligned(8))) = {
 
 #define RELOC(sym) *(typeof(&(sym)))(((void *)&(sym)) - KERNBASE)
 
+// Available physical memory reported by the boot loader
+struct memrange memranges[NMEMRANGE];
+int nmemrange;
+
+// Record an available range of physical memory,
+// ignoring whatever lies above 4GB.
+static void
+memrange_add(uint64_t addr, uint64_t len)
+{
+    struct memrange *mr = RELOC(memranges);
+    int *n = &RELOC(nmemrange);
+    uint64_t end = addr + len;
+    if (addr >= 0x100000000ULL || !len || *n >= NMEMRANGE)
+        return;
+    if (end > 0xfffff000ULL)
+        end = 0xfffff000ULL;
+    mr[*n].start = addr;
+    mr[*n].end = end;
+    (*n) ++;
+}
+
 // Called by entry.S with flat page mapping
 // Use RELOC(sym) to refer to global symbols
 void multiboot_init(uint32_t magic, uint32_t addr)
 {
     // Multiboot 1
     if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
-        RELOC(PHYSTOP) = (void *)(1024*1024 + 1024*((struct multiboot_info *)addr)->mem_upper);
+        struct multiboot_info *mbi = (void *)addr;
+        if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+            uint32_t p = mbi->mmap_addr;
+            for (; p < mbi->mmap_addr + mbi->mmap_length; p += ((multiboot_memory_map_t *)p)->size + 4) {
+                multiboot_memory_map_t *e = (void *)p;
+                if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+                    memrange_add(e->addr, e->len);
+            }
+        }
+        else if (mbi->flags & MULTIBOOT_INFO_MEMORY)
+            memrange_add(EXTMEM, 1024ULL*mbi->mem_upper);
     }
     // Multiboot 2
     else if (magic == MULTIBOOT2_BOOTLOADER_MAGIC) {
         uint32_t total_size = *(uint32_t *)addr;
+        uint32_t mem_upper = 0;
         struct multiboot_tag *tag;
         for (tag = (struct multiboot_tag *) (addr + 8);
             tag->type != MULTIBOOT_TAG_TYPE_END;
             tag = (struct multiboot_tag *) ((uint8_t *) tag + ((tag->size + 7) & ~7))) {
 
             switch(tag->type) {
+            case MULTIBOOT_TAG_TYPE_MMAP: {
+                struct multiboot_tag_mmap *mt = (void *)tag;
+                struct multiboot2_mmap_entry *e = mt->entries;
+                for (; (void *)e < (void *)tag + tag->size; e = (void *)e + mt->entry_size)
+                    if (e->type == MULTIBOOT_MEMORY_AVAILABLE)
+                        memrange_add(e->addr, e->len);
+                break;
+            }
             case MULTIBOOT_TAG_TYPE_BASIC_MEMINFO: 
-                RELOC(PHYSTOP) = (void *)(1024*1024 + 1024*((struct multiboot_tag_basic_meminfo *) tag)->mem_upper);
+                mem_upper = ((struct multiboot_tag_basic_meminfo *) tag)->mem_upper;
                 break;
 
             case MULTIBOOT_TAG_TYPE_ACPI_OLD:
@@ -59,6 +99,9 @@ void multiboot_init(uint32_t magic, uint32_t addr)
                 break;
             }
         }
+        // Fall back to basic memory information without a memory map
+        if (!RELOC(nmemrange))
+            memrange_add(EXTMEM, 1024ULL*mem_upper);
     }
     else {
         while(1);
@@ -30,6 +30,14 @@
 #define MULTIBOOT_INFO_CMDLINE                  0x00000004
 /* are there modules to do something with? */
 #define MULTIBOOT_INFO_MODS                     0x00000008
+/* is there a full memory map? */
+#define MULTIBOOT_INFO_MEM_MAP                  0x00000040
+
+/*  Flags set in the 'flags' member of the multiboot header. */
+/* Align all boot modules on i386 page (4KB) boundaries. */
+#define MULTIBOOT_PAGE_ALIGN                    0x00000001
+/* Must pass memory information to OS. */
+#define MULTIBOOT_MEMORY_INFO                   0x00000002
 
 typedef unsigned char           multiboot_uint8_t;
 typedef unsigned short          multiboot_uint16_t;
@@ -134,6 +142,22 @@ struct multiboot_info
   };
 };
 typedef struct multiboot_info multiboot_info_t;
+
+#define MULTIBOOT_MEMORY_AVAILABLE              1
+#define MULTIBOOT_MEMORY_RESERVED               2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE       3
+#define MULTIBOOT_MEMORY_NVS                    4
+#define MULTIBOOT_MEMORY_BADRAM                 5
+
+/* size does not count itself */
+struct multiboot_mmap_entry
+{
+  multiboot_uint32_t size;
+  multiboot_uint64_t addr;
+  multiboot_uint64_t len;
+  multiboot_uint32_t type;
+} __attribute__((packed));
+typedef struct multiboot_mmap_entry multiboot_memory_map_t;
 /* Multiboot 1 End */
 
 #define MULTIBOOT_TAG_ALIGN                  8
@@ -275,21 +299,13 @@ struct multiboot_color
   uint8_t blue;
 };
 
-/*
-struct multiboot_mmap_entry
+struct multiboot2_mmap_entry
 {
   uint64_t addr;
   uint64_t len;
-#define MULTIBOOT_MEMORY_AVAILABLE              1
-#define MULTIBOOT_MEMORY_RESERVED               2
-#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE       3
-#define MULTIBOOT_MEMORY_NVS                    4
-#define MULTIBOOT_MEMORY_BADRAM                 5
   uint32_t type;
   uint32_t zero;
 };
-typedef struct multiboot_mmap_entry multiboot_memory_map_t;
-*/
 
 struct multiboot_tag
 {
@@ -330,16 +346,14 @@ struct multiboot_tag_bootdev
   uint32_t part;
 };
 
-/*
 struct multiboot_tag_mmap
 {
   uint32_t type;
   uint32_t size;
   uint32_t entry_size;
   uint32_t entry_version;
-  struct multiboot_mmap_entry entries[0];  
+  struct multiboot2_mmap_entry entries[0];  
 };
-*/
 
 struct multiboot_vbe_info_block
 {
@@ -20,7 +20,10 @@ void swtchc(struct context **old, struct context *new);// In swtchc.S
 struct proc *
 thisproc()
 {
-    return thiscpu()->proc;
+    pushcli();
+    struct proc *p = thiscpu()->proc;
+    popcli();
+    return p;
 }
 
 struct proc *
@@ -38,12 +41,15 @@ sched_init()
     thiscpu()->proc = tp;
 }
 
+// Idle cpus zero pages in advance for kalloc_zero,
+// and halt when there is nothing else to do.
 void
 scheduler()
 {
     while(1) {
         cli();
-        sched();
+        if (!sched() && !zpool_fill())
+            sched_idle();
         sti();
     }
 }
@@ -52,36 +58,42 @@ void
 reap(struct proc *p)
 {
     cprintf("proc_free: %x\n", p);
+    assert(list_empty(&p->wait_list));
     vm_free(p->vm);
     kfree((void *)p + sizeof(struct proc) - KSTKSIZE);
-
-    assert(!list_find(&ptable.hlist[PROC_HASH(p)], &p->hlist));
-    assert(!list_find(&ptable.ready_list, &p->hlist));
-    assert(!list_find(&ptable.zombie_list, &p->hlist));
-    assert(list_empty(&p->wait_list));
 }
 
 // Switch to process p
-// Call should hold ptable.lock
-void
+// Caller should hold ptable.lock, or the run queue lock in
+// handoff if it is sched. Returns what swtch_done returns.
+int
 swtch(struct proc *p)
 {   
     struct proc *tp = thisproc();
     vm_switch(p->vm);
     thiscpu()->proc = p;
+    p->cpu = cpuidx();
+    // No time slice for the scheduler
+    timer_arm(p == thisched() ? 0 : p->ticks);
     tss_init();
     //cprintf("swtch: cpu %d, %x -> %x\n", cpuidx(), tp, p);
+    // intena belongs to this thread rather than this cpu
+    int intena = thiscpu()->intena;
+    thiscpu()->prev = tp;
     swtchc(&tp->context, p->context);
+    thiscpu()->intena = intena;
+    return swtch_done(thiscpu()->prev);
 }
 
 
 void
 forkret()
 {
+    if (swtch_done(thiscpu()->prev))
+        release(&ptable.lock);
     cprintf("forkret\n");
     ipc_init(thisproc());
     tss_init();
-    release(&ptable.lock);
 }
 
 //  Initial Kernel 
@@ -98,7 +110,8 @@ forkret()
 //  +------------+
 //  |  ...       |
 //  +------------+   bottom
-// Caller should hold ptable.lock
+// The process is not known to anyone until proc_attach.
+// Returns 0 if out of memory.
 struct proc *
 proc_alloc(uint32_t entry, int driver) {
     struct hackframe {
@@ -108,7 +121,10 @@ proc_alloc(uint32_t entry, int driver) {
         struct proc p;
     } __attribute__((packed)) *hf;
 
-    hf = (void *)kalloc(KSTKSIZE) + KSTKSIZE - sizeof(*hf);
+    void *kstk = kalloc(KSTKSIZE);
+    if (!kstk)
+        return 0;
+    hf = kstk + KSTKSIZE - sizeof(*hf);
 
     struct trapframe *tf = &hf->tf;
 
@@ -132,17 +148,27 @@ proc_alloc(uint32_t entry, int driver) {
 
     struct proc *p = &hf->p;
     p->context = &hf->context; // stack pointer
-    p->magic = PROC_MAGIC;
+    p->pid = 0;
     p->size = 0;
-    p->vm = vm_init();
+    p->driver = driver;
+    p->cpu = -1;
+    p->oncpu = p->onrq = 0;
+    p->class = p->prio = driver ? PRIO_DRIVER : PRIO_USER;
+    p->affinity = ~0;
+    if (!(p->vm = vm_init())) {
+        kfree(kstk);
+        return 0;
+    }
 
     list_init(&p->pos);
-    list_push_back(&ptable.hlist[PROC_HASH(p)], &p->hlist);
     list_init(&p->wait_list);
 
     return p;
 }
 
+// Create a process from elf, to be started by proc_start.
+// The image is copied through the kernel mapping, so this needs no lock.
+// Returns 0 if out of memory.
 struct proc *
 spawnx(struct elfhdr *elf, int driver)
 {
@@ -153,8 +179,9 @@ spawnx(struct elfhdr *elf, int driver)
     struct proghdr *eph = ph + elf->phnum;
 
     struct proc *p = proc_alloc(elf->entry, driver);
+    if (!p)
+        return 0;
 
-    vm_switch(p->vm);
     // Load each program segment (ignores ph flags).
     for(; ph < eph; ph++) {
         if (ph->type != ELF_PROG_LOAD)
@@ -163,22 +190,25 @@ spawnx(struct elfhdr *elf, int driver)
         assert(ph->va + ph->memsz > ph->va);
         assert(ph->va + ph->memsz <= KERNBASE);
 
-        vm_alloc(p->vm, ph->va, ph->memsz);
-
-        //copy to proc's virtual memory
-        memmove((void *)ph->va, (void *)elf + ph->offset, ph->filesz);
-        //BSS initialization
-        if(ph->memsz > ph->filesz) 
-            memset((void *)ph->va + ph->filesz, 0, ph->memsz - ph->filesz);
+        //copy to proc's virtual memory,
+        //BSS is left as is since vm_alloc gives zeroed pages
+        if (vm_alloc(p->vm, ph->va, ph->memsz) < 0)
+            goto bad;
+        if (vm_copyout(p->vm, ph->va, (void *)elf + ph->offset, ph->filesz) < 0)
+            panic("spawnx: segment not mapped\n");
     }
-    vm_switch(thisproc()->vm);
 
 	// One page for initial stack at va USTACKTOP - PGSIZE.
-    vm_alloc(p->vm, USTKTOP - PGSIZE, PGSIZE);
+    if (vm_alloc(p->vm, USTKTOP - PGSIZE, PGSIZE) < 0)
+        goto bad;
 
-    list_push_back(&ptable.ready_list, &p->pos);
     cprintf("spawnx: finish ucode loading.\n");
     return p;
+
+bad:
+    vm_free(p->vm);
+    kfree((void *)p + sizeof(struct proc) - KSTKSIZE);
+    return 0;
 }
 
 int
@@ -0,0 +1,259 @@
+// Compressed swap in memory.
+//
+// When memory is low, idle cpus compress cold user pages of processes
+// not running on any cpu into blobs kept in slab caches of a few size
+// classes. The PTE of a swapped page is left not present with PTE_SWAP
+// set and the physical address of its blob, which keeps the flags of
+// the PTE, and the page is brought back by the page fault handler. Pages mapped more than once, device
+// memory, DMA buffers and mailboxes are never swapped.
+//
+// Accessed bits give cold pages a second chance: a page is swapped only
+// if it has not been accessed since the last scan of its address space.
+// As the address space is not loaded on any cpu, clearing the bit needs
+// no TLB shootdown. Only processes off the run queues are scanned, as
+// those on them may be dispatched without ptable.lock.
+//
+// Victims are chosen under ptable.lock, each held by a page reference,
+// and compressed after it is released. The swap PTE is installed only
+// if the page is still mapped there, unaccessed and its process not
+// running, so a page touched meanwhile is left in place. The kernel
+// writes to user pages only through user mappings, e.g. uvm_copyout,
+// which sets the accessed bit too.
+#include <arch/i386/inc.h>
+
+#define NZCLASS     5
+#define ZCLASS_MIN  64                              // Smallest blob
+#define ZCLASS_MAX  (ZCLASS_MIN << (NZCLASS - 1))   // Pages compressed larger stay
+#define SWAP_BATCH  16                              // Pages swapped per call
+
+struct zblob {
+    uint16_t len;               // Compressed size
+    uint16_t flags;             // Of the PTE it replaced
+    uint8_t cls;                // Size class
+    uint8_t data[];
+};
+
+static struct kmem_cache *zcaches[NZCLASS];
+static char *znames[NZCLASS] = {"zswap64", "zswap128", "zswap256", "zswap512", "zswap1024"};
+
+// Compression state of the one cpu in swap_reclaim, see zbusy
+static volatile int zbusy;
+static uint16_t zdict[1 << LZ_HASHBITS];
+static uint8_t zbuf[ZCLASS_MAX];
+static int zslot;               // Where swap_reclaim starts next time, under ptable.lock
+static struct victim {
+    int pid;
+    uint32_t va;
+    void *pg;                   // Held by a reference
+    struct zblob *b;            // Its compressed copy, or null
+} victims[SWAP_BATCH];
+
+// Statistics. Those of swapping out are only written by the cpu
+// in swap_reclaim, the others are atomic.
+static struct {
+    uint32_t nout, nin;         // Pages swapped out and in
+    uint32_t nskip;             // Pages too large compressed
+    uint32_t nraced;            // Pages touched while being compressed
+    uint32_t nstored;           // Blobs alive
+    uint32_t bytes;             // Compressed bytes alive
+    uint32_t cout_k, cin_k;     // Kilocycles compressing and faulting in
+    uint32_t cin_max;           // Slowest fault-in in cycles
+} zstat;
+
+void
+swap_init()
+{
+    for (int i = 0; i < NZCLASS; i ++)
+        zcaches[i] = kmem_cache_create(znames[i], ZCLASS_MIN << i, 0, 0);
+}
+
+// Compress page pg into a blob.
+// Returns the blob, or 0 if the page is not worth swapping
+// or there is no memory for it.
+static struct zblob *
+swap_compress(void *pg)
+{
+    uint64_t t = rdtsc();
+    int n = lz_compress(pg, PGSIZE, zbuf, ZCLASS_MAX - sizeof(struct zblob), zdict);
+    if (n < 0) {
+        zstat.nskip ++;
+        return 0;
+    }
+    int cls = 0;
+    while ((ZCLASS_MIN << cls) < n + sizeof(struct zblob))
+        cls ++;
+    struct zblob *b = kmem_cache_alloc(zcaches[cls]);
+    if (!b)
+        return 0;
+    b->len = n;
+    b->cls = cls;
+    memmove(b->data, zbuf, n);
+    zstat.cout_k += (rdtsc() - t) >> 10;
+    return b;
+}
+
+// Choose up to n cold pages of process p, which should not be
+// active, as victims from victims[nv] on, taking a reference
+// to each. Returns the number of victims after them.
+// Caller should hold ptable.lock.
+static int
+swap_choose(struct proc *p, int nv, int n)
+{
+    pde_t *pgdir = (void *)p->vm;
+    for (int i = 0; i < PDX(KERNBASE) && nv < n; i ++) {
+        if (!(pgdir[i] & PTE_P))
+            continue;
+        pte_t *pgt = P2V(PTE_ADDR(pgdir[i]));
+        for (int j = 0; j < NPTENTRIES && nv < n; j ++) {
+            if (!(pgt[j] & PTE_P) || PGADDR(i, j, 0) == USTKTOP)
+                continue;
+            if (pgt[j] & PTE_A) {
+                pgt[j] &= ~PTE_A;
+                continue;
+            }
+            void *pg = P2V(PTE_ADDR(pgt[j]));
+            struct page *d = va2page(pg);
+            if (!d || (d->flags & (PG_KMEM | PG_PINNED)) != PG_KMEM || d->ref != 1)
+                continue;
+            page_get(pg);
+            victims[nv].pid = p->pid;
+            victims[nv].va = (uint32_t)PGADDR(i, j, 0);
+            victims[nv].pg = pg;
+            nv ++;
+        }
+    }
+    return nv;
+}
+
+// Whether p runs or may start to without ptable.lock,
+// see proc_claim. onrq is read first, as it is cleared last.
+// Caller should hold ptable.lock.
+static int
+proc_active(struct proc *p)
+{
+    return p->onrq || p->oncpu;
+}
+
+// Install the blob of victim v in place of its page, if the page is
+// still mapped at the same address, not accessed since it was chosen,
+// held only by its mapping and our reference, and its process is not
+// active. Returns 0 on success, or -1 if the victim should stay.
+// Caller should hold ptable.lock.
+static int
+swap_install(struct victim *v)
+{
+    struct proc *p = pid2proc(v->pid);
+    if (!p || proc_active(p))
+        return -1;
+    pte_t *pte = pgdir_walk((pde_t *)p->vm, (void *)v->va, 0);
+    if (!pte || (*pte & (PTE_P | PTE_A)) != PTE_P || P2V(PTE_ADDR(*pte)) != v->pg ||
+        va2page(v->pg)->ref != 2)
+        return -1;
+    v->b->flags = PTE_FLAGS(*pte);
+    *pte = V2P(v->b) | PTE_SWAP;
+    return 0;
+}
+
+// Swap out cold pages of processes that are not active,
+// going round the process table. Only one cpu does it at a time,
+// and the pages are compressed without ptable.lock.
+// Called by the scheduler with no lock held.
+void
+swap_reclaim()
+{
+    if (__sync_lock_test_and_set(&zbusy, 1))
+        return;
+
+    int nv = 0;
+    acquire(&ptable.lock);
+    for (int k = 0; k < NPROC && nv < SWAP_BATCH; k ++) {
+        zslot = (zslot + 1) % NPROC;
+        struct proc *p = ptable.procs[zslot];
+        if (p && !proc_active(p))
+            nv = swap_choose(p, nv, SWAP_BATCH);
+    }
+    release(&ptable.lock);
+
+    for (int i = 0; i < nv; i ++)
+        victims[i].b = swap_compress(victims[i].pg);
+
+    // A blob may be swapped in and freed as soon as it is installed
+    acquire(&ptable.lock);
+    for (int i = 0; i < nv; i ++) {
+        struct zblob *b = victims[i].b;
+        if (!b)
+            continue;
+        __sync_fetch_and_add(&zstat.nstored, 1);
+        __sync_fetch_and_add(&zstat.bytes, b->len);
+        if (swap_install(&victims[i])) {
+            zstat.nraced ++;
+            swap_free(V2P(b) | PTE_SWAP);
+            victims[i].b = 0;
+        }
+        else
+            zstat.nout ++;
+    }
+    release(&ptable.lock);
+
+    // Drop our reference, and the mapping's of swapped pages
+    for (int i = 0; i < nv; i ++) {
+        if (victims[i].b)
+            page_put(victims[i].pg);
+        page_put(victims[i].pg);
+    }
+    __sync_lock_release(&zbusy);
+}
+
+// Bring back the page swapped at va of vm.
+// Returns 0 on success, or -1 if va is not swapped or out of memory.
+int
+swap_in(struct vm *vm, uint32_t va)
+{
+    pte_t *pte = pgdir_walk((pde_t *)vm, (void *)va, 0);
+    if (!pte || (*pte & (PTE_P | PTE_SWAP)) != PTE_SWAP)
+        return -1;
+
+    uint64_t t = rdtsc();
+    void *pg = kalloc(PGSIZE);
+    if (!pg)
+        return -1;
+    struct zblob *b = P2V(SWAP_ADDR(*pte));
+    if (lz_decompress(b->data, b->len, pg, PGSIZE) != PGSIZE)
+        panic("swap_in: corrupted page at 0x%x\n", va);
+    va2page(pg)->owner = vm;
+    uint32_t flags = b->flags;
+    swap_free(*pte);
+    *pte = V2P(pg) | flags;
+
+    uint32_t c = rdtsc() - t, m;
+    __sync_fetch_and_add(&zstat.nin, 1);
+    __sync_fetch_and_add(&zstat.cin_k, c >> 10);
+    while ((m = zstat.cin_max) < c && !__sync_bool_compare_and_swap(&zstat.cin_max, m, c))
+        ;
+    return 0;
+}
+
+// Free the blob of a swapped pte
+void
+swap_free(pte_t pte)
+{
+    struct zblob *b = P2V(SWAP_ADDR(pte));
+    __sync_fetch_and_sub(&zstat.nstored, 1);
+    __sync_fetch_and_sub(&zstat.bytes, b->len);
+    kmem_cache_free(zcaches[b->cls], b);
+}
+
+void
+swap_stat()
+{
+    cprintf("swap: out %d, in %d, too large %d, touched while compressed %d\n",
+        zstat.nout, zstat.nin, zstat.nskip, zstat.nraced);
+    cprintf("swap: %d pages in %d bytes", zstat.nstored, zstat.bytes);
+    if (zstat.nstored)
+        cprintf(", %d%% of original", zstat.bytes / (zstat.nstored * (PGSIZE / 100)));
+    cprintf("\n");
+    if (zstat.nout)
+        cprintf("swap: compress avg %d kcycles\n", zstat.cout_k / zstat.nout);
+    if (zstat.nin)
+        cprintf("swap: fault-in avg %d kcycles, max %d cycles\n", zstat.cin_k / zstat.nin, zstat.cin_max);
+}
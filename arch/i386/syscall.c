@@ -39,21 +39,62 @@ sys_fork() {
     return fork();
 }
 
+// Sleep for ms milliseconds
 static int
-sys_sleep()
+sys_sleep(int ms)
 {
-    panic("sys_sleep: TODO\n");
-    acquire(&ptable.lock);
-    //sleep();
-    release(&ptable.lock);
+    if (ms > 0)
+        msleep(ms);
     return 0;
 }
 
 static int
 sys_yield() {
-    acquire(&ptable.lock);
-    yield(0);
-    release(&ptable.lock);
+    sched_yield();
+    return 0;
+}
+
+// Allocate n physically contiguous pages for a driver's DMA
+// and map them at va. Returns their physical address, or -1.
+static int
+sys_dmalloc(uint32_t va, int n)
+{
+    if (!thisproc()->driver)
+        return -1;
+    return vm_alloc_contig(thisproc()->vm, va, n);
+}
+
+// Set the time slice to ticks timer ticks, for drivers only.
+// Returns the old one, or -1.
+static int
+sys_quantum(int ticks)
+{
+    if (!thisproc()->driver || ticks <= 0)
+        return -1;
+    return __sync_lock_test_and_set(&quantum, ticks);
+}
+
+// Store the monotonic clock in nanoseconds at ns.
+static int
+sys_clock(uint64_t *ns)
+{
+    uint64_t t = clock_ns();
+    return uvm_copyout(thisproc()->vm, (uint32_t)ns, &t, sizeof(t));
+}
+
+// Dump kernel statistics selected by what to the console.
+static int
+sys_kstat(int what)
+{
+    switch(what) {
+        case KSTAT_MEM: kmem_stat(); kmem_cache_stat(); break;
+        case KSTAT_MEMSITE: kmem_site_stat(); break;
+        case KSTAT_SWAP: swap_stat(); break;
+        case KSTAT_LOCK: lockstat_dump(); break;
+        case KSTAT_INTR: intr_stat(); break;
+        case KSTAT_PROC: proc_stat(); break;
+        default: return -1;
+    }
     return 0;
 }
 
@@ -79,14 +120,22 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
         case SYS_cgetc: return sys_cgetc(); 
 
         case SYS_exit:  return sys_exit(); 
-        case SYS_sleep: return sys_sleep(); 
+        case SYS_sleep: return sys_sleep(a1); 
         case SYS_fork:  return sys_fork();
         case SYS_yield:  return sys_yield();
         case SYS_sbrk:  return (int32_t)sbrk(a1);
+        case SYS_memwatch:  return memwatch();
+        case SYS_dmalloc:   return sys_dmalloc(a1, a2);
+        case SYS_quantum:   return sys_quantum(a1);
+        case SYS_setprio:   return setprio(a1);
+        case SYS_setaffinity:   return setaffinity(a1);
+        case SYS_clock:     return sys_clock((uint64_t *)a1);
 
         case SYS_send:   return sys_send(a1, a2);
         case SYS_recv:   return sys_recv(a1, a2);
 
+        case SYS_kstat:  return sys_kstat(a1);
+
         default: panic("syscall: not implemented.\n");
     }
     return 0;
@@ -33,9 +33,29 @@ trap(struct trapframe *tf)
             tf->eax = syscall(tf->eax, tf->edx, tf->ecx, tf->ebx, tf->edi, tf->esi);
             break;
 
+        case T_PGFLT:
+            if (rcr2() < KERNBASE && !swap_in(thisproc()->vm, rcr2()))
+                break;
+            if ((tf->cs & 3) && rcr2() < KERNBASE) {
+                cprintf("page fault: proc 0x%x, va 0x%x, eip 0x%x, killed\n", thisproc(), rcr2(), tf->eip);
+                exit();
+            }
+            cprintf("tf number: %d, thisproc: %x, cr2: %x, eip: %x\n", tf->trapno, thisproc(), rcr2(), tf->eip);
+            panic("page fault in kernel.\n");
+
         case T_IRQ0 + IRQ_TIMER:
-            //cprintf("%d", cpuidx());
+            thiscpu()->ntimer ++;
+            lapic_eoi();
+            // In kernel mode timer_intr retries in a tick
+            if (timer_intr() && (tf->cs & 3))
+                sched_preempt(1);
+            break;
+
+        case T_IRQ0 + IRQ_RESCHED:
+            thiscpu()->nresched ++;
             lapic_eoi();
+            if (tf->cs & 3)
+                sched_preempt(0);
             break;
 
         case T_IRQ0 + IRQ_KBD:
@@ -53,5 +73,10 @@ trap(struct trapframe *tf)
             cprintf("tf number: %d, thisproc: %x, cr2: %x, eip: %x\n", tf->trapno, thisproc(), rcr2(), tf->eip);
             panic("tf not implemented.\n");
     }
+
+    // Run what an interrupt queued above this process on this cpu,
+    // as no IPI is sent to it for that
+    if ((tf->cs & 3) && ptable.runq[cpuidx()].resched)
+        sched_preempt(0);
 }
 
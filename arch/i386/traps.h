@@ -75,6 +75,7 @@ struct trapframe {
 #define IRQ_COM1         4
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+#define IRQ_RESCHED     20      // IPI to wake a halted cpu
 #define IRQ_SPURIOUS    31
 
 #endif
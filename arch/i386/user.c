@@ -13,31 +13,52 @@
 #define LOAD_USER(name) ({LOAD_X(name, 0); })
 #define LOAD_DRIVER(name) ({LOAD_X(name, 1); })
 
-struct proc *utable[NUSERS];
+// Pids of the drivers and servers, 0 until they are started
+int utable[NUSERS];
 
 void
-user_intr(struct proc *p)
+user_intr(int pid)
 {
-    sys_send((int)p, 0);
+    sys_send(pid, 0);
 }
 
 // Load drivers and user-space server
 void
 user_init()
 {
-    acquire(&ptable.lock);
+    // No process runs yet, so nothing else spawns and spawn_mutex,
+    // which only processes may block on, is not needed.
+    struct proc *test = LOAD_USER(test);
+    struct proc *fs = LOAD_USER(fs);
+    if (fs)
+        fs->class = fs->prio = PRIO_SERVER;
 
-    //LOAD_USER(test);
-    LOAD_USER(fs);
+    struct proc *kbd = LOAD_DRIVER(kbd); // Keyboard Driver
+    struct proc *vga = LOAD_DRIVER(vga); // VGA Driver
+    if (!test || !fs || !kbd || !vga)
+        panic("user_init: out of memory\n");
 
-    utable[USER_KBD] = LOAD_DRIVER(kbd); // Keyboard Driver
-    utable[USER_VGA] = LOAD_DRIVER(vga); // VGA Driver
+    // Keep the keyboard driver on the cpu its interrupts
+    // are routed to, which is apic 0 by main.c
+    for (int i = 0; i < ncpu; i ++)
+        if (cpus[i].apicid == 0)
+            kbd->affinity = 1 << i;
 
     // Map CGA Memory for VGA driver
-    pte_t *pte = pgdir_walk((pde_t *)(utable[USER_VGA]->vm), (void *)0xb8000, 1);
-    assert(!(*pte & PTE_P));
-    *pte = 0xb8000 | PTE_P | PTE_W | PTE_U;
+    vm_map(vga->vm, 0xb8000, 0xb8000, PTE_W | PTE_U);
 
+    // Other cpus are already scheduling and processes copy utable
+    // into their mailboxes when they first run, so it is filled
+    // before any of them is queued.
+    acquire(&ptable.lock);
+    if (proc_attach(test) || proc_attach(fs) || proc_attach(kbd) || proc_attach(vga))
+        panic("user_init: process table full\n");
+    utable[USER_KBD] = kbd->pid;
+    utable[USER_VGA] = vga->pid;
+    proc_run(fs);
+    proc_run(kbd);
+    proc_run(vga);
+    proc_run(test);
     release(&ptable.lock);
     //proc_stat();
     cprintf("user init finished.\n");
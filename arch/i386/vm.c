@@ -3,21 +3,47 @@
 
 pde_t entry_pgdir[NPDENTRIES] __attribute__((__aligned__(PGSIZE)));
 
-// Set up GDT for this CPU
+// Page tables and page directories are recycled through slab caches.
+// They are freed with all user entries cleared, so a page table
+// never needs zeroing and a page directory never needs the kernel
+// part copied again once constructed.
+static struct kmem_cache *pgtable_cache, *pgdir_cache;
+
+// The user part is already zeroed
+static void
+pgdir_ctor(void *pgdir)
+{
+    uint32_t k = PDX(KERNBASE);
+    memmove((pde_t *)pgdir + k, entry_pgdir + k, (NPDENTRIES - k) * sizeof(pde_t));
+}
+
+void
+pgcache_init()
+{
+    pgtable_cache = kmem_cache_create("pgtable", PGSIZE, KMC_ZERO, 0);
+    pgdir_cache = kmem_cache_create("pgdir", PGSIZE, KMC_ZERO, pgdir_ctor);
+}
+
+// Set up GDT for this CPU.
+// Before acpi_init finds the cpus, the boot cpu borrows cpus[0]
+// for thiscpu(), e.g. for pushcli to work.
 void 
 seg_init()
 {
     // Map "logical" addresses to virtual addresses using identity map.
-    struct cpu *c = &cpus[cpuidx()];
+    struct cpu *c = ncpu ? cpu_probe() : &cpus[0];
     c->gdt[SEG_KCODE] = SEG(STA_X | STA_R, 0, 0xffffffff, PL_KERN);
     c->gdt[SEG_KDATA] = SEG(STA_W        , 0, 0xffffffff, PL_KERN);
     c->gdt[SEG_DCODE] = SEG(STA_X | STA_R, 0, 0xffffffff, PL_DRIVER);
     c->gdt[SEG_DDATA] = SEG(STA_W        , 0, 0xffffffff, PL_DRIVER);
     c->gdt[SEG_UCODE] = SEG(STA_X | STA_R, 0, 0xffffffff, PL_USER);
     c->gdt[SEG_UDATA] = SEG(STA_W        , 0, 0xffffffff, PL_USER);
+    c->gdt[SEG_KCPU]  = SEG(STA_W, &c->self, 8, PL_KERN);
+    c->self = c;
 
     extern void loadgdt(void *, int);// in entry.S
     loadgdt(c->gdt, sizeof(c->gdt) - 1);
+    loadgs(SEG_SELECTOR(SEG_KCPU, TI_GDT, RPL_KERN));
     //lgdt(c->gdt, sizeof(c->gdt));
 }
 
@@ -46,9 +72,9 @@ tss_init()
 //
 // The relevant page table page might not exist yet.
 // If this is true, and alloc == false, then pgdir_walk returns NULL.
-// Otherwise, pgdir_walk allocates a new page table page with kalloc.
+// Otherwise, pgdir_walk allocates a new page table page from pgtable_cache.
 // 		- If the allocation fails, pgdir_walk returns NULL.
-// 		- Otherwise, the new page is cleared, and pgdir_walk returns
+// 		- Otherwise, the new page is already cleared, and pgdir_walk returns
 //        a pointer into the new page table page.
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int32_t alloc)
@@ -58,12 +84,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int32_t alloc)
     pte_t *pgt;
     if (*pde_p & PTE_P) 
         pgt = (pte_t *)P2V(PTE_ADDR(*pde_p));
-    else if (!alloc || (pgt = (pte_t *)kalloc(PGSIZE)) == 0)
+    else if (!alloc || (pgt = kmem_cache_alloc(pgtable_cache)) == 0)
         return 0;
-    else {
-        memset(pgt, 0, PGSIZE);
+    else 
         *pde_p = V2P(pgt) | PTE_P | PTE_W | PTE_U;
-    }
     return &pgt[PTX(va)];
 }
 
@@ -71,9 +95,7 @@ pgdir_walk(pde_t *pgdir, const void *va, int32_t alloc)
 struct vm *
 vm_init()
 {
-    pde_t *pgdir = kalloc(PGSIZE);
-    memmove(pgdir, entry_pgdir, sizeof(entry_pgdir));
-    return (struct vm *)pgdir;
+    return kmem_cache_alloc(pgdir_cache);
 }
 
 // Switch h/w page table register to the page table.
@@ -84,7 +106,10 @@ vm_switch(struct vm *pgdir)
 }
 
 // Map len bytes beginning at virtual address va 
-void
+// to zeroed pages.
+// Returns 0 on success, or -1 if out of memory, leaving
+// the pages mapped so far for the caller to unmap.
+int
 vm_alloc(struct vm *vm, uint32_t va, uint32_t len)
 {
     pde_t *pgdir = (void *)vm;
@@ -97,16 +122,76 @@ vm_alloc(struct vm *vm, uint32_t va, uint32_t len)
         assert(va < KERNBASE);
 
         pte_t *pte = pgdir_walk(pgdir, (void *)va, 1);
-        if (!(*pte & PTE_P)) 
-            *pte = V2P(kalloc(PGSIZE)) | PTE_P | PTE_U | PTE_W;
+        if (!pte)
+            return -1;
+        if (!*pte) {
+            void *p = kalloc_zero();
+            if (!p)
+                return -1;
+            va2page(p)->owner = vm;
+            *pte = V2P(p) | PTE_P | PTE_U | PTE_W;
+        }
         if (va == ve) 
             break;
         va += PGSIZE;
     }
+    return 0;
+}
+
+// Map the page at virtual address va to physical address pa,
+// which may be a page of another address space or device memory.
+void
+vm_map(struct vm *vm, uint32_t va, uint32_t pa, int perm)
+{
+    assert(va < KERNBASE && !(va % PGSIZE) && !(pa % PGSIZE));
+    pte_t *pte = pgdir_walk((pde_t *)vm, (void *)va, 1);
+    assert(!*pte);
+    page_get(P2V(pa));
+    *pte = pa | perm | PTE_P;
+}
+
+// Map n pages beginning at virtual address va to physically
+// contiguous, zeroed and pinned pages, e.g. for DMA.
+// The range should be below USTKTOP, as the mailbox and the heap
+// sbrk grows and shrinks without looking at what is mapped are above.
+// Returns the physical address of the first page, or -1 if
+// [va, va + n pages) is not free or out of memory.
+int
+vm_alloc_contig(struct vm *vm, uint32_t va, int n)
+{
+    pde_t *pgdir = (void *)vm;
+    uint32_t ve = va + (uint32_t)n * PGSIZE;
+    if (va % PGSIZE || n <= 0 || n > (1 << BUDDY_MAXORDER) || ve <= va || ve > USTKTOP)
+        return -1;
+    for (uint32_t v = va; v < ve; v += PGSIZE) {
+        pte_t *pte = pgdir_walk(pgdir, (void *)v, 0);
+        if (pte && *pte)
+            return -1;
+    }
+
+    char *p = kalloc_contig(n);
+    if (!p)
+        return -1;
+    memset(p, 0, n * PGSIZE);
+    for (int i = 0; i < n; i ++) {
+        pte_t *pte = pgdir_walk(pgdir, (void *)(va + i * PGSIZE), 1);
+        if (!pte) {
+            if (i)
+                vm_dealloc(vm, va, i * PGSIZE);
+            for (; i < n; i ++)
+                kfree(p + i * PGSIZE);
+            return -1;
+        }
+        struct page *pg = va2page(p + i * PGSIZE);
+        pg->owner = vm;
+        pg->flags |= PG_PINNED;
+        *pte = V2P(p + i * PGSIZE) | PTE_P | PTE_U | PTE_W;
+    }
+    return V2P(p);
 }
 
 // Unmap len bytes beginning at virtual address va 
-// All intersected pages will be freed.
+// All intersected pages will be released.
 int
 vm_dealloc(struct vm *vm, uint32_t va, uint32_t len)
 {
@@ -120,11 +205,13 @@ vm_dealloc(struct vm *vm, uint32_t va, uint32_t len)
         assert(va < KERNBASE);
         assert(va != USTKTOP);
 
-        pte_t *pte = pgdir_walk(pgdir, (void *)va, 1);
-        if (*pte & PTE_P) {
-            kfree(P2V(PTE_ADDR(*pte)));
+        pte_t *pte = pgdir_walk(pgdir, (void *)va, 0);
+        if (pte && (*pte & PTE_P))
+            page_put(P2V(PTE_ADDR(*pte)));
+        else if (pte && (*pte & PTE_SWAP))
+            swap_free(*pte);
+        if (pte)
             *pte = 0;
-        }
         if (va == ve) 
             break;
         va += PGSIZE;
@@ -162,22 +249,78 @@ vm_fork(struct vm *vm)
 }
 */
 
-// Free the user space of a page table
-void 
-vm_free(struct vm *vm)
+// Free the user space of a page table, clearing
+// entries on the way to give back constructed objects.
+// The page table itself is kept.
+void
+vm_clear(struct vm *vm)
 {
     pde_t *pgdir = (void *)vm;
     for (int i = 0; i < PDX(KERNBASE); i ++) {
         if (pgdir[i] & PTE_P) {
             pte_t *pgt = P2V(PTE_ADDR(pgdir[i]));
-            for (int i = 0; i < NPDENTRIES; i ++) {
-                if (pgt[i] & PTE_P) 
-                    kfree(P2V(PTE_ADDR(pgt[i])));
+            for (int j = 0; j < NPTENTRIES; j ++) {
+                if (pgt[j] & PTE_P) 
+                    page_put(P2V(PTE_ADDR(pgt[j])));
+                else if (pgt[j] & PTE_SWAP)
+                    swap_free(pgt[j]);
+                pgt[j] = 0;
             }
-            kfree(pgt);
+            kmem_cache_free(pgtable_cache, pgt);
+            pgdir[i] = 0;
         }
     }
-    kfree(pgdir);
+}
+
+void 
+vm_free(struct vm *vm)
+{
+    vm_clear(vm);
+    kmem_cache_free(pgdir_cache, vm);
+}
+
+// Copy len bytes at src to va of vm through the kernel mapping,
+// so vm need not be loaded.
+// Returns 0, or -1 if some page is not mapped.
+int
+vm_copyout(struct vm *vm, uint32_t va, void *src, uint32_t len)
+{
+    while (len) {
+        pte_t *pte = pgdir_walk((pde_t *)vm, (void *)va, 0);
+        if (!pte || !(*pte & PTE_P))
+            return -1;
+        uint32_t n = MIN(len, PGSIZE - PGO(va));
+        memmove(P2V(PTE_ADDR(*pte)) + PGO(va), src, n);
+        va += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copy len bytes at src to user address va of vm, checking that
+// every page is present and writable by the user first.
+// Swapped pages are brought back. vm should be loaded on this cpu,
+// and the copy goes through its mapping to set the accessed bits
+// swap_reclaim relies on. Returns 0, or -1 if some page is not
+// mapped, read-only or in the kernel.
+int
+uvm_copyout(struct vm *vm, uint32_t va, void *src, uint32_t len)
+{
+    uint32_t ve = va + len;
+    if (!len)
+        return 0;
+    if (ve < va || ve > KERNBASE)
+        return -1;
+    for (uint32_t p = ROUNDDOWN(va, PGSIZE); p < ve; p += PGSIZE) {
+        pte_t *pte = pgdir_walk((pde_t *)vm, (void *)p, 0);
+        if (pte && !(*pte & PTE_P) && (*pte & PTE_SWAP) && swap_in(vm, p))
+            return -1;
+        if (!pte || (*pte & (PTE_P | PTE_U | PTE_W)) != (PTE_P | PTE_U | PTE_W))
+            return -1;
+    }
+    memmove((void *)va, src, len);
+    return 0;
 }
 
 // Check that the user has permission to read memory [s, s+len).
@@ -110,6 +110,25 @@ loadgs(uint16_t v)
     asm volatile("movw %0, %%gs" : : "r" (v));
 }
 
+// Divide n by d, where the quotient should fit in 32 bits.
+// The kernel has no libgcc for 64-bit division.
+static inline uint32_t
+divl(uint64_t n, uint32_t d)
+{
+    uint32_t q, r;
+    if ((uint32_t)(n >> 32) >= d)
+        return ~0;
+    asm("divl %4" : "=a" (q), "=d" (r) : "a" ((uint32_t)n), "d" ((uint32_t)(n >> 32)), "rm" (d));
+    return q;
+}
+
+static inline void
+pause(void)
+{
+    // Also a compiler barrier, so spin loops reread what they wait on
+    asm volatile("pause" ::: "memory");
+}
+
 static inline void
 cli(void)
 {
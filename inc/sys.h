@@ -15,6 +15,17 @@ enum {
     NUSERS
 };
 
+// Scheduling priority classes, highest first
+enum {
+    PRIO_DRIVER = 0,
+    PRIO_SERVER,
+    PRIO_USER,
+    NPRIO
+};
+
+// Signals in the irq bitmap of mailbox
+#define SIG_SHRINK 31           // Memory is low, give back what you can
+
 struct mailbox {
     BITMAP_STATIC(irq, 32);
     int len;
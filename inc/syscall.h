@@ -15,6 +15,12 @@ enum {
     SYS_yield, 
     SYS_fork,
     SYS_sbrk, 
+    SYS_memwatch,
+    SYS_dmalloc,
+    SYS_quantum,
+    SYS_setprio,
+    SYS_setaffinity,
+    SYS_clock,
 
     // IPC
     SYS_send,
@@ -30,7 +36,22 @@ enum {
     SYS_msgrcv, 
     SYS_test, 
 
+    // Statistics
+    SYS_kstat,
+
 	NSYSCALLS
 };
 
+/* kstat() selectors, dumping kernel statistics to the console */
+enum {
+    KSTAT_MEM = 0,
+    KSTAT_MEMSITE,          // Live pages by allocation site
+    KSTAT_SWAP,             // Compressed swap
+    KSTAT_LOCK,             // Contention of named locks
+    KSTAT_INTR,             // Interrupt latency
+    KSTAT_PROC,             // Process lists
+
+    NKSTATS
+};
+
 #endif /* ! INC_SYSCALL_H */
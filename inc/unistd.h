@@ -4,8 +4,15 @@
 
 void *sbrk(int);
 int fork();
-int sleep();
+int sleep(int ms);
 int yield();
+int kstat(int);
+int memwatch();      // Get SIG_SHRINK in the mailbox when memory is low
+int dmalloc(void *va, int n);   // Drivers only, returns the physical address
+int quantum(int ticks);         // Drivers only, returns the old time slice
+int setprio(int prio);          // PRIO_*, no higher than the one spawned with
+int setaffinity(unsigned mask); // Run only on the cpus in mask, bit i for cpu i
+unsigned long long clock_ns();  // Monotonic nanoseconds since boot
 //int sendi(int, int, int);
 //int recvi();
 
@@ -5,35 +5,161 @@
 #include <inc/types.h>
 #include <inc/bitmap.h>
 #include <inc/list.h>
+#include <inc/sys.h>
 
 #define PGSIZE 4096
 
+// Maximum number of CPUs
+#define NCPU  8
+
 // In kern/spinlock.c
+// Contention statistics of a lock named by lock_init,
+// updated by the holder. Times are in cycles.
+struct lockstat {
+    char *name;                     // Null if statistics are off
+    uint32_t nacq;                  // Acquisitions
+    uint32_t ncontend;              // Acquisitions that had to wait
+    uint64_t spin;                  // Total time waiting
+    uint32_t spin_max;
+    uint64_t hold;                  // Total time held
+    uint32_t hold_max;
+    uint64_t tacq;                  // When the holder got it
+    void *eip;                      // Where the last holder took it
+};
+#define NLOCKSTAT 32                // Maximum number of named locks
+
+// Ticket lock, fair but all waiters spin on the same cache line
 struct spinlock {
-    volatile int locked;
+    volatile uint16_t next;         // Next ticket to hand out
+    volatile uint16_t owner;        // Ticket holding the lock
+    struct lockstat stat;
+};
+
+// MCS lock, fair and each waiter spins on its own cache line
+struct mcsnode {
+    struct mcsnode *volatile next;  // Next waiter
+    volatile int locked;            // Cleared when the lock is handed over
+} __attribute__((aligned(64)));
+
+struct mcslock {
+    struct mcsnode *volatile tail;  // Last waiter, or null if free
+    struct lockstat stat;
+    struct mcsnode node[NCPU];      // Indexed by cpuidx()
 };
-void acquire(struct spinlock *);
-void release(struct spinlock *);
+
+void spin_acquire(struct spinlock *);
+int  spin_tryacquire(struct spinlock *);    // Returns 1 if taken
+void spin_release(struct spinlock *);
+void mcs_acquire(struct mcslock *);
+void mcs_release(struct mcslock *);
+void lockstat_init(struct lockstat *, char *name);
+void lockstat_dump();
+
+// Name a lock of either kind and keep its statistics
+#define lock_init(lk, name) lockstat_init(&(lk)->stat, name)
+
+#define acquire(lk) _Generic((lk),          \
+    struct spinlock *: spin_acquire,        \
+    struct mcslock *: mcs_acquire)(lk)
+#define release(lk) _Generic((lk),          \
+    struct spinlock *: spin_release,        \
+    struct mcslock *: mcs_release)(lk)
 
 // In kern/mm.c
+#define BUDDY_MAXORDER 10   // Largest block is 4MB
+#define MAG_SIZE       32   // Pages cached per cpu
+#define MAG_BATCH      16   // Pages moved at once between a magazine and the buddy system
+#define ZPOOL_SIZE     64   // Pages kept zeroed for kalloc_zero
+
+// Per-cpu stash of free pages in front of memlock. Its lock is
+// taken by its cpu, and by mag_shrink to drain it from any cpu.
+struct magazine {
+    struct spinlock lock;
+    int cnt;
+    void *pages[MAG_SIZE];
+    uint32_t nalloc, nfree;     // Pages served by and returned to the magazine
+    uint32_t nrefill, ndrain;   // Times memlock is taken to refill or drain
+};
+
+// Physical page descriptor, one per page frame
+struct page {
+    uint16_t ref;               // Holders of the page, e.g. mappings
+    uint8_t flags;              // PG_*
+    uint8_t order;              // Order of the block it heads
+    uint8_t site;               // Slot of its allocation site, see kern/mm.c
+    void *owner;                // Address space it is allocated for, if any
+    struct list_head lru;       // In a free list of the buddy system
+};
+#define PG_KMEM 0x1         // Managed by kalloc, not a hole, the kernel or a device
+#define PG_FREE 0x2         // Heads a free block
+#define PG_PINNED 0x4       // Stays in memory, e.g. under DMA, until freed
+
+extern struct page *pages;  // Indexed by physical frame number
+
+void kmem_init(void *start, void *end);
 void free_range(void *start, void *end);
 void *kalloc(size_t sz);
 void kfree(void *v);
+void *kalloc_zero();
+void *kalloc_contig(int n);
+int  zpool_fill();
+struct page *va2page(void *va);
+void *page2va(struct page *);
+void page_get(void *va);
+void page_put(void *va);
+void kmem_stat();
+void kmem_site_stat();
+
+// Frees kernel caches when memory runs out, returning pages freed
+struct shrinker {
+    int (*shrink)();
+    struct list_head link;
+};
+void register_shrinker(struct shrinker *);
+int  kmem_reclaim();
+int  kmem_lowmem();
+int  kmem_low();
+
+// In kern/lz.c
+#define LZ_HASHBITS 12
+int lz_compress(const uint8_t *in, int n, uint8_t *out, int cap, uint16_t *dict);
+int lz_decompress(const uint8_t *in, int n, uint8_t *out, int cap);
 
-// Large Prime Number: https://planetmath.org/goodhashtableprimes
-#define PROC_BUCKET_SIZE     769
-#define PROC_HASH(x)         (((uint32_t)x) % PROC_BUCKET_SIZE)
-#define PROC_EXISTS(p) (list_find(&ptable.hlist[PROC_HASH(p)], &(p)->hlist) && (p)->magic == PROC_MAGIC)
-#define PROC_MAGIC 0xabcdcccc
+// In kern/slab.c
+struct kmem_cache;
+#define KMC_ZERO 0x1        // Objects are zeroed before ctor, from the pre-zeroed pool
+void  kmem_cache_init();
+struct kmem_cache *kmem_cache_create(char *name, size_t sz, int flags, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *);
+void  kmem_cache_free(struct kmem_cache *, void *);
+void  kmem_cache_stat();
+
+// A pid is a slot of ptable.procs and the generation of the slot,
+// which changes each time it is freed, so stale pids find nothing.
+#define NPROC_BITS      10
+#define NPROC           (1 << NPROC_BITS)
+#define PID_SLOT(pid)   ((uint32_t)(pid) & (NPROC - 1))
+#define PID_GEN_MAX     (1u << (31 - NPROC_BITS))   // Keeps pids positive
+#define PROC_EXISTS(p)  ((p) && ptable.procs[PID_SLOT((p)->pid)] == (p))
+#define QUANTUM    2                // Default time slice in timer ticks
+#define TICK_MS    10               // Length of a timer tick
 
 struct proc {
-    int magic;
+    int pid;                    // 0 until proc_attach
     int size;
+    int driver;                 // May access devices
+    int cpu;                    // Last ran on, -1 if never
+    int ticks;                  // Length of its time slice, set when dispatched
+    int class;                  // Highest priority it may take
+    int prio;                   // PRIO_*, from class
+    uint32_t affinity;          // Cpus it may run on, bit i for cpu i
+    uint32_t nivcsw;            // Times preempted
+    volatile int oncpu;         // Claimed by a cpu and not yet off its stack
+    volatile int onrq;          // In a run queue
 
-    struct list_head hlist;
     struct list_head wait_list;
     struct list_head pos;       // Scheduled by whom, either empty
-                                // or in ready_list, or in zombie_list
+                                // or in a runq, or in the zombies of a cpu
     struct mailbox *mailbox;
 
     // Architexture dependent part
@@ -41,25 +167,86 @@ struct proc {
     struct context  *context;   // Context
 };
 
+// Runnable processes of a cpu, under its lock, and the state
+// of the context switch in progress on the cpu.
+struct runq {
+    struct spinlock lock;       // Taken after ptable.lock if both are held
+    struct list_head procs[NPRIO];  // Linked by pos, one list per priority
+    volatile int n[NPRIO];      // Lengths of procs, may be read without the lock
+    volatile int nmobile[NPRIO];    // Of which may run on any cpu
+    uint32_t nsteal;            // Processes this cpu took from others
+    volatile int idle;          // Halted or about to, see sched_idle
+    volatile int resched;       // Something above the running process was queued
+                                // here, to preempt it on the way back to user
+    uint32_t nhalt;             // Times halted
+    struct spinlock *handoff;   // Held across the switch instead of ptable.lock
+} __attribute__((aligned(64)));
+
+// ptable.lock guards the process table, wait lists, mutexes and
+// whether a process sleeps, i.e. has an empty pos. Run queues have
+// their own locks, so dispatching a process does not take it.
 struct ptable {
-    struct spinlock lock;
-    struct list_head hlist[PROC_BUCKET_SIZE];   // Hash Map of all proc
-    struct list_head ready_list;                // list of runnable proc 
-    struct list_head zombie_list;               // list of zombie proc
+    struct mcslock lock;
+    struct proc *procs[NPROC];                  // Live proc by pid slot
+    uint32_t gen[NPROC];                        // Generation of each slot
+    int nextslot;                               // Where to look for a free slot
+    struct runq runq[NCPU];                     // runnable proc of each cpu
+};
+
+// Sleepable mutex for long critical sections, under ptable.lock.
+// Only processes may block on it, and it is handed to waiters in order.
+struct mutex {
+    struct proc *owner;
+    struct list_head waiters;   // Linked by pos
 };
 
 // In kern/proc.c
 extern struct ptable ptable;
+extern int quantum;                         // Time slice in timer ticks
 void         proc_init();
 void         proc_stat();
-void         sched();
+int          sched();
+void         sched_preempt(int);
+void         sched_yield();
+int          setprio(int);
+int          setaffinity(uint32_t);
+void         msleep(int);                    // Sleep for ms milliseconds
+void         sched_idle();
+int          swtch_done(struct proc *prev);
 void         exit();                         // Exit current process
 void         sleep();
 void         wakeup(struct proc *);
 void         yield(struct proc *);
 struct proc *serve();
-struct proc *spawn(struct elfhdr *);    // Create a new process specified by elf
+struct proc *spawn(struct elfhdr *, int);   // Create a new process specified by elf
+int          proc_start(struct proc *);
+int          proc_attach(struct proc *);
+void         proc_run(struct proc *);
+struct proc *pid2proc(int);
+void         mutex_init(struct mutex *);
+void         mutex_lock(struct mutex *);
+void         mutex_unlock(struct mutex *);
 void *       sbrk(int);
+int          memwatch();                     // Ask for SIG_SHRINK when memory is low
+void         memnotify();
+
+// In kern/timer.c
+// A callback to run once at a given time, on the timer interrupt of
+// the cpu that added it. It runs with interrupts off and may not sleep.
+struct timer {
+    struct list_head link;
+    uint32_t expires;           // In ticks since boot
+    void (*fn)(void *);
+    void *arg;
+    volatile int cpu;           // Wheel it is on, -1 if not pending
+};
+void timer_wheel_init();
+void timer_init(struct timer *, void (*)(void *), void *);
+void timer_add(struct timer *, int ms);  // Cut to about 23 hours
+int  timer_del(struct timer *);     // Returns 1 if it was pending
+int  timer_pending(struct timer *);
+void timer_arm(int slice);          // When switching to a process, or 0 for none
+int  timer_intr();                  // Returns 1 if the time slice is over
 
 // In kern/ipc.c
 int send(int, int);
@@ -72,6 +259,23 @@ extern int panicked;
 void cprintf(char *fmt, ...);
 void panic(char *fmt, ...);
 
+// In arch/xxx/cpu.c
+extern int ncpu;                    // Total number of CPUs in the system
+int cpuidx();
+struct magazine *cpu_mag(int);
+void pushcli();                     // Nested cli, undone by as many popcli
+void cpu_halt();                    // Turn on interrupts and wait for one
+void cpu_kick(int);                 // Wake a halted cpu
+void popcli();
+void intr_stat();
+
+// In arch/xxx/clock.c
+uint64_t clock_ns();                // Monotonic time since boot
+uint32_t clock_ms();
+
+// In arch/xxx/lapic.c
+void lapic_timer(int ticks);        // Interrupt this cpu once in ticks, never if 0
+
 // In arch/xxx/console.c
 void cons_init();
 void consputc(int c);
@@ -81,15 +285,19 @@ struct proc *thisproc();                // Get current process
 struct proc *thisched();                // Get current scheduler
 struct proc *proc_alloc(uint32_t, int);
 struct proc *spawnx(struct elfhdr *, int);
-void         swtch(struct proc *p);     // Switch to process p, including context and vm
+int          swtch(struct proc *p);     // Switch to process p, including context and vm
 void         reap(struct proc *p);      // Reap a process
 void         scheduler();
 
 // In arch/XXX/vm.c
 struct vm *vm_init();
 void       vm_switch(struct vm *);
-void       vm_alloc(struct vm *, uint32_t, uint32_t);
+int        vm_alloc(struct vm *, uint32_t, uint32_t);
 int        vm_dealloc(struct vm *, uint32_t, uint32_t);
+void       vm_clear(struct vm *);
 void       vm_free(struct vm *);
 
+// In arch/XXX/swap.c
+void       swap_reclaim();
+
 #endif
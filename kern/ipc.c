@@ -11,11 +11,11 @@
 int
 send(int pid, int cnt)
 {
-    struct proc *p = (struct proc *)pid;
+    struct proc *p;
     struct mailbox *tm;
     int sent = 0;
     acquire(&ptable.lock);
-    if (PROC_EXISTS(p)) {
+    if ((p = pid2proc(pid))) {
         if (cnt <= 0) {
             bitmap_set(p->mailbox->irq, -cnt, 1);
             wakeup(p);
@@ -48,7 +48,7 @@ recv(int pid, int cnt)
         bitmap_set(tm->irq, -cnt, 0);
     }
     else {
-        while ((int)(p = serve()) != pid && pid) 
+        while ((p = serve())->pid != pid && pid) 
             p->mailbox->len = -1;
 
         m = p->mailbox;
@@ -57,6 +57,6 @@ recv(int pid, int cnt)
         //cprintf("sys_recv(cpu %d): %s recv from %s, cnt %d\n", cpuidx(), tp->name, p->name, cnt);
     }
     release(&ptable.lock);
-    return (int)p;
+    return p ? p->pid : 0;
 }
 
@@ -0,0 +1,137 @@
+// A small LZ77 compressor in the spirit of LZ4, for swapping pages
+// to memory. The output is a list of sequences, each being
+//  - a token: literal length in the high nibble and match length
+//    minus LZ_MINMATCH in the low nibble, where 15 means more length
+//    follows as bytes of 255 ended by a byte less than 255,
+//  - the literals,
+//  - a 2-byte little endian offset back to the match, and more
+//    match length if any.
+// The last sequence only has literals and ends the input.
+#include <inc/string.h>
+#include <kern/inc.h>
+
+#define LZ_MINMATCH 4
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+    return *(const uint32_t *)p;
+}
+
+static inline uint32_t
+lz_hash(const uint8_t *p)
+{
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+static inline void
+lz_putlen(uint8_t **op, int n)
+{
+    for (; n >= 255; n -= 255)
+        *(*op)++ = 255;
+    *(*op)++ = n;
+}
+
+static inline int
+lz_getlen(const uint8_t **ip, const uint8_t *iend)
+{
+    int n = 0, b;
+    do {
+        if (*ip >= iend)
+            return -1;
+        n += (b = *(*ip)++);
+    } while (b == 255);
+    return n;
+}
+
+// Compress n bytes at in into out, which can hold cap bytes.
+// dict is a work area of 1 << LZ_HASHBITS entries.
+// Returns the compressed size, or -1 if it does not fit in cap.
+int
+lz_compress(const uint8_t *in, int n, uint8_t *out, int cap, uint16_t *dict)
+{
+    const uint8_t *ip = in, *anchor = in, *end = in + n;
+    uint8_t *op = out, *oend = out + cap;
+    memset(dict, 0, sizeof(uint16_t) << LZ_HASHBITS);
+
+    while (ip + LZ_MINMATCH <= end) {
+        uint32_t h = lz_hash(ip);
+        const uint8_t *ref = in + dict[h];
+        dict[h] = ip - in;
+        if (ref >= ip || ip - ref > 0xffff || lz_read32(ref) != lz_read32(ip)) {
+            ip ++;
+            continue;
+        }
+
+        int len = LZ_MINMATCH;
+        while (ip + len < end && ref[len] == ip[len])
+            len ++;
+        int lit = ip - anchor, ml = len - LZ_MINMATCH, off = ip - ref;
+        if (op + 1 + lit + lit / 255 + 1 + 2 + ml / 255 + 1 > oend)
+            return -1;
+
+        *op++ = (MIN(lit, 15) << 4) | MIN(ml, 15);
+        if (lit >= 15)
+            lz_putlen(&op, lit - 15);
+        memmove(op, anchor, lit);
+        op += lit;
+        *op++ = off & 0xff;
+        *op++ = off >> 8;
+        if (ml >= 15)
+            lz_putlen(&op, ml - 15);
+        anchor = ip += len;
+    }
+
+    int lit = end - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > oend)
+        return -1;
+    *op++ = MIN(lit, 15) << 4;
+    if (lit >= 15)
+        lz_putlen(&op, lit - 15);
+    memmove(op, anchor, lit);
+    return op + lit - out;
+}
+
+// Decompress n bytes at in into out, which can hold cap bytes.
+// Returns the decompressed size, or -1 if the input is corrupted.
+int
+lz_decompress(const uint8_t *in, int n, uint8_t *out, int cap)
+{
+    const uint8_t *ip = in, *iend = in + n;
+    uint8_t *op = out, *oend = out + cap;
+
+    while (ip < iend) {
+        int tok = *ip++, len;
+        int lit = tok >> 4;
+        if (lit == 15) {
+            if ((len = lz_getlen(&ip, iend)) < 0)
+                return -1;
+            lit += len;
+        }
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memmove(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        int ml = tok & 15;
+        if (ml == 15) {
+            if ((len = lz_getlen(&ip, iend)) < 0)
+                return -1;
+            ml += len;
+        }
+        ml += LZ_MINMATCH;
+        if (!off || off > op - out || ml > oend - op)
+            return -1;
+        // Byte by byte, since the match may overlap what it produces
+        for (uint8_t *r = op - off; ml --; )
+            *op++ = *r++;
+    }
+    return op - out;
+}
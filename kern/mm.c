@@ -1,96 +1,677 @@
+#include <inc/string.h>
 #include <kern/inc.h>
 
-struct freelist {
-    void *next;
-    void *start, *end;
-} freelist;
+// Page descriptors of all page frames below the top of memory,
+// indexed by physical frame number.
+struct page *pages;
+
+// Binary buddy system.
+// A block of order k is 2^k contiguous pages whose index (i.e. frame
+// number) is a multiple of 2^k. Free blocks are linked through the lru
+// of their first page, which records the order of the block and
+// carries PG_FREE. Only heads of free blocks carry PG_FREE, so blocks
+// never merge across holes.
+struct buddy_system {
+    char *base;                 // Address of page 0
+    int npages;
+    struct list_head free_list[BUDDY_MAXORDER + 1];
+    int nfree[BUDDY_MAXORDER + 1];  // Histogram of free blocks
+} buddy;
 
 static struct spinlock memlock;
+static int nlock;               // Times memlock is taken, under memlock
+
+// Free pages in the buddy system and extents, under memlock.
+// Crossing lowat downwards marks memory low, until it is back
+// above hiwat. Pages cached by magazines are not counted.
+static int nfreepg, lowat, hiwat;
+static int lowmem;              // Below lowat and not yet above hiwat
+static int lowmem_news;         // Memory just became low, see kmem_lowmem()
+static int nlowmem;             // Times memory became low
+
+// Kernel shrinkers, see register_shrinker()
+static struct list_head shrinkers;
+static struct shrinker zpool_shrinker, mag_shrinker;
+static struct spinlock shrinklock;
+static int nreclaim, nreclaimed;
 
-// Allocate one 4096-byte page of physical memory.
-// Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
+// Pages zeroed in advance by idle cpus
+static struct {
+    struct spinlock lock;
+    int cnt;
+    void *pages[ZPOOL_SIZE];
+    uint32_t nhit, nmiss;       // kalloc_zero served from the pool or not
+} zpool;
+
+static inline int
+buddy_idx(struct buddy_system *bsp, void *v)
+{
+    return ((char *)v - bsp->base) / PGSIZE;
+}
+
+static inline void *
+buddy_addr(struct buddy_system *bsp, int idx)
+{
+    return bsp->base + idx * PGSIZE;
+}
+
+static void
+buddy_push(struct buddy_system *bsp, int idx, int order)
+{
+    pages[idx].order = order;
+    pages[idx].flags |= PG_FREE;
+    list_push_front(&bsp->free_list[order], &pages[idx].lru);
+    bsp->nfree[order] ++;
+}
+
+static void
+buddy_drop(struct buddy_system *bsp, int idx, int order)
+{
+    pages[idx].flags &= ~PG_FREE;
+    list_drop(&pages[idx].lru);
+    bsp->nfree[order] --;
+}
+
+// Allocate a block of 2^order pages.
+// Split a larger block if no block of this order is free.
+// Returns 0 if there is no such a block.
 static void *
-freelist_alloc(struct freelist *f)
+buddy_alloc(struct buddy_system *bsp, int order)
 {
-    void *p = f->next;
-    if (p)
-        f->next = *(void **)p;
+    int o = order;
+    while (o <= BUDDY_MAXORDER && list_empty(&bsp->free_list[o]))
+        o ++;
+    if (o > BUDDY_MAXORDER)
+        return 0;
+
+    int idx = CONTAINER_OF(list_front(&bsp->free_list[o]), struct page, lru) - pages;
+    buddy_drop(bsp, idx, o);
+    // Give back the upper halves
+    while (o > order) {
+        o --;
+        buddy_push(bsp, idx + (1 << o), o);
+    }
+    pages[idx].order = order;
+    return buddy_addr(bsp, idx);
+}
+
+// Free the block at v, merging it with its buddy
+// as long as the buddy is a free block of the same order.
+static void
+buddy_free(struct buddy_system *bsp, void *v)
+{
+    int idx = buddy_idx(bsp, v);
+    int o = pages[idx].order;
+    assert(!(pages[idx].flags & PG_FREE) && !(idx & ((1 << o) - 1)));
+
+    for (; o < BUDDY_MAXORDER; o ++) {
+        int b = idx ^ (1 << o);
+        if (b + (1 << o) > bsp->npages || !(pages[b].flags & PG_FREE) || pages[b].order != o)
+            break;
+        buddy_drop(bsp, b, o);
+        idx &= b;
+    }
+    buddy_push(bsp, idx, o);
+}
+
+// Free memory not yet given to the buddy system. An extent is
+// broken into blocks only when the buddy system runs dry, so boot
+// time does not grow with the amount of memory.
+#define NEXTENT 16
+static struct extent {
+    char *start, *end;
+} extents[NEXTENT];
+static int nextent;
+static int nmanaged;            // Pages handed to free_range
+
+// Break the next block off the free extents into the buddy system.
+// Returns 0 if all extents are used up.
+// Caller should hold memlock.
+static int
+extent_carve()
+{
+    while (nextent && extents[nextent - 1].start == extents[nextent - 1].end)
+        nextent --;
+    if (!nextent)
+        return 0;
+
+    struct extent *x = &extents[nextent - 1];
+    int idx = buddy_idx(&buddy, x->start);
+    int eidx = buddy_idx(&buddy, x->end);
+    int o = 0;
+    while (o < BUDDY_MAXORDER && !(idx & (1 << o)) && idx + (2 << o) <= eidx)
+        o ++;
+    x->start += PGSIZE << o;
+
+    // Freeing it merges the block with free neighbours
+    for (int i = 0; i < (1 << o); i ++)
+        pages[idx + i].flags = PG_KMEM;
+    pages[idx].order = o;
+    buddy_free(&buddy, buddy_addr(&buddy, idx));
+    return 1;
+}
+
+// Update the low memory state after nfreepg changed.
+// Caller should hold memlock.
+static void
+kmem_water()
+{
+    if (!lowmem && nfreepg < lowat) {
+        lowmem = lowmem_news = 1;
+        nlowmem ++;
+    }
+    else if (lowmem && nfreepg > hiwat)
+        lowmem = 0;
+}
+
+// Allocate 2^order pages, carving extents if needed.
+// Caller should hold memlock.
+static void *
+pages_alloc(int order)
+{
+    void *p;
+    while (!(p = buddy_alloc(&buddy, order)) && extent_carve())
+        ;
+    if (p) {
+        nfreepg -= 1 << order;
+        kmem_water();
+    }
     return p;
 }
 
-// Free the page of physical memory pointed at by v.
+// Give a block back to the buddy system.
+// Caller should hold memlock.
 static void
-freelist_free(struct freelist *f, void *v)
+pages_free(void *v)
 {
-    *(void **)v = f->next;
-    f->next = v;
+    nfreepg += 1 << pages[buddy_idx(&buddy, v)].order;
+    buddy_free(&buddy, v);
+    kmem_water();
 }
 
+// Give pages in [start, end) to the allocator as a free extent.
+// The page descriptor array is taken from the first extent
+// large enough to hold it.
 void
 free_range(void *start, void *end)
 {
+    char *s = ROUNDUP((char *)start, PGSIZE);
+    char *e = ROUNDDOWN((char *)end, PGSIZE);
     acquire(&memlock);
-    int cnt = 0;
-	char *p = ROUNDUP((char *)start, PGSIZE);
-	for (; p + PGSIZE <= (char *)end; p += PGSIZE, cnt ++) 
-		freelist_free(&freelist, p);
-    cprintf("free_range: 0x%x ~ 0x%x, %d pages\n", start, end, cnt);
+    assert(s >= buddy.base && buddy_idx(&buddy, e) <= buddy.npages);
+    size_t sz = buddy.npages * sizeof(struct page);
+    if (!pages && e - s > sz) {
+        pages = (struct page *)s;
+        memset(pages, 0, sz);
+        s = ROUNDUP(s + sz, PGSIZE);
+    }
+    if (s < e) {
+        assert(nextent < NEXTENT);
+        extents[nextent].start = s;
+        extents[nextent].end = e;
+        nextent ++;
+        nmanaged += (e - s) / PGSIZE;
+        nfreepg += (e - s) / PGSIZE;
+        lowat = nmanaged / 32;
+        hiwat = nmanaged / 16;
+    }
+    cprintf("free_range: 0x%x ~ 0x%x, %d pages\n", start, end, (e - s) / PGSIZE);
     release(&memlock);
 }
 
-// Allocate sz size of physical memory.
+// Manage physical memory within [start, end) with the buddy system,
+// where start is the address of frame 0. Memory is given by
+// free_range later, and the rest are holes.
+void
+kmem_init(void *start, void *end)
+{
+    buddy.base = ROUNDUP((char *)start, PGSIZE);
+    buddy.npages = (ROUNDDOWN((char *)end, PGSIZE) - buddy.base) / PGSIZE;
+    assert(buddy.npages > 0);
+    for (int i = 0; i <= BUDDY_MAXORDER; i ++)
+        list_init(&buddy.free_list[i]);
+    list_init(&shrinkers);
+    lock_init(&memlock, "memlock");
+    lock_init(&zpool.lock, "zpool");
+    list_push_back(&shrinkers, &zpool_shrinker.link);
+    list_push_back(&shrinkers, &mag_shrinker.link);
+}
+
+// Live pages by allocation site, to find out who holds memory.
+// Sites are return addresses of kalloc callers, kept in an open
+// addressing hash table filled without locks: a slot is claimed by
+// a CAS on its pc and never given back. Slot 0 takes the sites that
+// find the table full. Each allocated block records its slot.
+#define NSITE 256
+static struct site {
+    void *pc;
+    int npages;                 // Pages allocated and not freed yet
+    int nalloc;                 // Allocations ever made
+} sites[NSITE];
+
+static int
+site_slot(void *pc)
+{
+    uint32_t h = ((uint32_t)pc >> 2) % (NSITE - 1);
+    for (int i = 0; i < NSITE - 1; i ++) {
+        struct site *s = &sites[1 + (h + i) % (NSITE - 1)];
+        if (s->pc == pc)
+            return s - sites;
+        if (!s->pc && (!__sync_val_compare_and_swap(&s->pc, 0, pc) || s->pc == pc))
+            return s - sites;
+    }
+    return 0;
+}
+
+static void
+site_add(struct page *pg, void *pc)
+{
+    pg->site = site_slot(pc);
+    __sync_fetch_and_add(&sites[pg->site].npages, 1 << pg->order);
+    __sync_fetch_and_add(&sites[pg->site].nalloc, 1);
+}
+
+static void
+site_del(struct page *pg)
+{
+    __sync_fetch_and_sub(&sites[pg->site].npages, 1 << pg->order);
+}
+
+// Take a page from this cpu's magazine,
+// refilling MAG_BATCH pages from the buddy system if it is empty.
+static void *
+mag_alloc(struct magazine *m)
+{
+    void *p;
+    acquire(&m->lock);
+    if (!m->cnt) {
+        acquire(&memlock);
+        nlock ++;
+        while (m->cnt < MAG_BATCH && (m->pages[m->cnt] = pages_alloc(0)))
+            m->cnt ++;
+        release(&memlock);
+        m->nrefill ++;
+    }
+    m->nalloc ++;
+    p = m->cnt ? m->pages[--m->cnt] : 0;
+    release(&m->lock);
+    return p;
+}
+
+// Put a page into this cpu's magazine. If it is full, 
+// drain the MAG_BATCH coldest pages to the buddy system.
+static void
+mag_free(struct magazine *m, void *v)
+{
+    acquire(&m->lock);
+    if (m->cnt == MAG_SIZE) {
+        acquire(&memlock);
+        nlock ++;
+        for (int i = 0; i < MAG_BATCH; i ++)
+            pages_free(m->pages[i]);
+        release(&memlock);
+        memmove(m->pages, m->pages + MAG_BATCH, (MAG_SIZE - MAG_BATCH) * sizeof(void *));
+        m->cnt -= MAG_BATCH;
+        m->ndrain ++;
+    }
+    m->nfree ++;
+    m->pages[m->cnt++] = v;
+    release(&m->lock);
+}
+
+// Allocate sz size of physical memory on behalf of site,
+// rounded up to 2^n pages and physically contiguous.
+// Single pages come from the per-cpu magazine.
 // Returns 0 if failed else a pointer.
-void *
-kalloc(size_t sz)
+static void *
+kalloc_at(size_t sz, void *site)
 {
-    acquire(&memlock);
-    //void *p = buddy_alloc(bsp, sz);
-    void *p = freelist_alloc(&freelist);
-    assert((int)p);
-
-    #ifdef DEBUG
-    cprintf("kalloc: p: 0x%x, sz: %d\n", p, sz);
-    assert(p);
-    int alloc = 0;
-    for (int i = 0; i < MAXN; i ++) {
-        if (!pool[i]) {
-            pool[i] = p;
-            alloc = 1;
-            break;
-        }
+    int order = 0;
+    void *p;
+    while ((PGSIZE << order) < sz)
+        order ++;
+
+    if (!order) {
+        pushcli();
+        p = mag_alloc(cpu_mag(cpuidx()));
+        popcli();
+    }
+    else {
+        acquire(&memlock);
+        nlock ++;
+        p = pages_alloc(order);
+        release(&memlock);
     }
-    assert(alloc);
-    #endif
+    if (!p)
+        return 0;
+    struct page *pg = &pages[buddy_idx(&buddy, p)];
+    pg->ref = 1;
+    pg->owner = 0;
+    site_add(pg, site);
+    return p;
+}
 
+// Run the shrinkers after an allocation of 2^order pages failed.
+// Returns 1 if it is worth another try, which is when a block large
+// enough is free now and fewer than KALLOC_TRIES tries were made.
+// Shrinkers may give back pages that idle cpus take again at once,
+// e.g. by zpool_fill, so that they freed some is not enough.
+#define KALLOC_TRIES 4
+static int
+kalloc_retry(int order, int *tries)
+{
+    if (++*tries >= KALLOC_TRIES || !kmem_reclaim())
+        return 0;
+    acquire(&memlock);
+    int o = order;
+    while (o <= BUDDY_MAXORDER && list_empty(&buddy.free_list[o]))
+        o ++;
     release(&memlock);
+    return o <= BUDDY_MAXORDER;
+}
+
+void *
+kalloc(size_t sz)
+{
+    void *p, *site = __builtin_return_address(0);
+    int order = 0, tries = 0;
+    while ((PGSIZE << order) < sz)
+        order ++;
+    while (!(p = kalloc_at(sz, site)) && kalloc_retry(order, &tries))
+        ;
     return p;
 }
 
-// Free the physical memory pointed at by v.
+// Free the physical memory pointed at by v,
+// which should be returned by kalloc and not shared.
 void
 kfree(void *va)
 {
+    // The order of an allocated block only changes when it is freed,
+    // so it is safe to read without memlock.
+    struct page *pg = &pages[buddy_idx(&buddy, va)];
+    assert((pg->flags & PG_KMEM) && !(pg->flags & PG_FREE) && pg->ref <= 1);
+    pg->ref = 0;
+    pg->flags &= ~PG_PINNED;
+    site_del(pg);
+    if (!pg->order) {
+        pushcli();
+        mag_free(cpu_mag(cpuidx()), va);
+        popcli();
+        return;
+    }
     acquire(&memlock);
+    nlock ++;
+    pages_free(va);
+    release(&memlock);
+}
 
-    #ifdef DEBUG
-    cprintf("kfree: va: 0x%x, ", va);
-    int nalloc = 0;
-    int valid = 0;
-    for (int i = 0; i < MAXN; i ++) {
-        if (!valid && pool[i] == va) {
-            valid = 1;
-            pool[i] = 0;
-        }
-        else if (pool[i]) nalloc ++;
-    }
-    assert(valid);
-    cprintf("nalloc: %d\n", nalloc);
-    #endif
-
-    freelist_free(&freelist, va);
-    //buddy_free(bsp, va);
+// Allocate n physically contiguous pages, each of which can be freed
+// on its own. The surplus of the power-of-two block is given back.
+// Returns 0 if failed or n is not positive, else a pointer.
+void *
+kalloc_contig(int n)
+{
+    if (n <= 0)
+        return 0;
+    int order = 0;
+    while ((1 << order) < n)
+        order ++;
+    if (order > BUDDY_MAXORDER)
+        return 0;
+
+    char *p;
+    int tries = 0;
+    do {
+        acquire(&memlock);
+        nlock ++;
+        p = pages_alloc(order);
+        release(&memlock);
+    } while (!p && kalloc_retry(order, &tries));
+    if (!p)
+        return 0;
+
+    acquire(&memlock);
+    int idx = buddy_idx(&buddy, p);
+    for (int i = n; i < (1 << order); ) {
+        int o = 0;
+        while (!((i >> o) & 1) && i + (2 << o) <= (1 << order))
+            o ++;
+        pages[idx + i].order = o;
+        pages_free(p + i * PGSIZE);
+        i += 1 << o;
+    }
     release(&memlock);
+
+    void *site = __builtin_return_address(0);
+    for (struct page *pg = va2page(p); pg < va2page(p) + n; pg ++) {
+        pg->order = 0;
+        pg->ref = 1;
+        pg->owner = 0;
+        site_add(pg, site);
+    }
+    return p;
+}
+
+// Descriptor of the page at va,
+// or 0 if va is not below the top of memory.
+struct page *
+va2page(void *va)
+{
+    if ((char *)va < buddy.base || (char *)va >= (char *)buddy_addr(&buddy, buddy.npages))
+        return 0;
+    return &pages[buddy_idx(&buddy, va)];
+}
+
+void *
+page2va(struct page *pg)
+{
+    return buddy_addr(&buddy, pg - pages);
+}
+
+// Take a reference to the page at va, e.g. for one more mapping.
+// Pages not from kalloc, such as device memory, are not counted.
+void
+page_get(void *va)
+{
+    struct page *pg = va2page(va);
+    if (pg && (pg->flags & PG_KMEM)) {
+        assert(pg->ref);
+        __sync_fetch_and_add(&pg->ref, 1);
+    }
+}
+
+// Drop a reference to the page at va, freeing it with the last one.
+void
+page_put(void *va)
+{
+    struct page *pg = va2page(va);
+    if (pg && (pg->flags & PG_KMEM) && !__sync_sub_and_fetch(&pg->ref, 1))
+        kfree(va);
+}
+
+// Allocate a zeroed page, from the pre-zeroed pool if possible.
+// Returns 0 if failed else a pointer.
+void *
+kalloc_zero()
+{
+    void *p = 0, *site = __builtin_return_address(0);
+    acquire(&zpool.lock);
+    if (zpool.cnt) {
+        p = zpool.pages[--zpool.cnt];
+        zpool.nhit ++;
+    }
+    else
+        zpool.nmiss ++;
+    release(&zpool.lock);
+
+    if (p) {
+        // Charge it to the caller instead of zpool_fill
+        struct page *pg = va2page(p);
+        site_del(pg);
+        site_add(pg, site);
+    }
+    else {
+        int tries = 0;
+        while (!(p = kalloc_at(PGSIZE, site)) && kalloc_retry(0, &tries))
+            ;
+        if (p)
+            memset(p, 0, PGSIZE);
+    }
+    return p;
+}
+
+// Zero one free page into the pre-zeroed pool.
+// Called by idle cpus, returns 0 if the pool is already full
+// or memory is low.
+int
+zpool_fill()
+{
+    if (zpool.cnt >= ZPOOL_SIZE || lowmem)
+        return 0;
+    void *p = kalloc(PGSIZE);
+    if (!p)
+        return 0;
+    memset(p, 0, PGSIZE);
+
+    acquire(&zpool.lock);
+    if (zpool.cnt < ZPOOL_SIZE) {
+        zpool.pages[zpool.cnt++] = p;
+        p = 0;
+    }
+    release(&zpool.lock);
+    if (p)
+        kfree(p);
+    return 1;
+}
+
+// Give back the pre-zeroed pool
+static int
+zpool_shrink()
+{
+    int n = 0;
+    void *p;
+    while (1) {
+        acquire(&zpool.lock);
+        p = zpool.cnt ? zpool.pages[--zpool.cnt] : 0;
+        release(&zpool.lock);
+        if (!p)
+            return n;
+        kfree(p);
+        n ++;
+    }
+}
+
+// Give back the magazines of all cpus, so their pages can merge
+// into larger blocks and none are left on other cpus.
+// No magazine lock is held around kalloc, so they can be waited for.
+static int
+mag_shrink()
+{
+    int n = 0;
+    for (int i = 0; i < ncpu; i ++) {
+        struct magazine *m = cpu_mag(i);
+        acquire(&m->lock);
+        acquire(&memlock);
+        n += m->cnt;
+        while (m->cnt)
+            pages_free(m->pages[--m->cnt]);
+        release(&memlock);
+        release(&m->lock);
+    }
+    return n;
+}
+
+static struct shrinker zpool_shrinker = { .shrink = zpool_shrink };
+static struct shrinker mag_shrinker = { .shrink = mag_shrink };
+
+// Register a callback to free kernel caches when memory runs out.
+// It is called by kalloc, so it should neither allocate memory
+// nor take any lock that may be held around kalloc.
+void
+register_shrinker(struct shrinker *s)
+{
+    acquire(&shrinklock);
+    list_push_back(&shrinkers, &s->link);
+    release(&shrinklock);
 }
 
+// Run all shrinkers, returning the number of pages freed.
+int
+kmem_reclaim()
+{
+    int n = 0;
+    struct shrinker *s;
+    acquire(&shrinklock);
+    LIST_FOREACH_ENTRY(s, &shrinkers, link)
+        n += s->shrink();
+    nreclaim ++;
+    nreclaimed += n;
+    release(&shrinklock);
+    return n;
+}
+
+// Return 1 if memory is below the low watermark
+// and has not been back above the high one.
+int
+kmem_low()
+{
+    return lowmem;
+}
 
+// Return 1 once each time memory falls below the low watermark,
+// for the caller to ask servers to give memory back.
+int
+kmem_lowmem()
+{
+    return __sync_lock_test_and_set(&lowmem_news, 0);
+}
+
+// Print the free-block histogram of the buddy system
+// and how often each cpu's magazine falls back to memlock.
+void
+kmem_stat()
+{
+    int total = 0;
+    for (int i = 0; i < ncpu; i ++) {
+        struct magazine *m = cpu_mag(i);
+        cprintf("kmem: cpu %d: %d cached, alloc %d, free %d, refill %d, drain %d\n",
+            i, m->cnt, m->nalloc, m->nfree, m->nrefill, m->ndrain);
+        total += m->cnt;
+    }
+    acquire(&memlock);
+    cprintf("kmem: memlock taken %d times\n", nlock);
+    cprintf("kmem: zero pool: %d pages, hit %d, miss %d\n", zpool.cnt, zpool.nhit, zpool.nmiss);
+    total += zpool.cnt;
+    cprintf("kmem: free blocks by order:");
+    for (int i = 0; i <= BUDDY_MAXORDER; i ++) {
+        cprintf(" %d", buddy.nfree[i]);
+        total += buddy.nfree[i] << i;
+    }
+    for (int i = 0; i < nextent; i ++)
+        total += (extents[i].end - extents[i].start) / PGSIZE;
+    cprintf("\nkmem: %d/%d pages free\n", total, nmanaged);
+    cprintf("kmem: watermarks %d/%d, %d free, low %d times, reclaim %d times, %d pages\n",
+        lowat, hiwat, nfreepg, nlowmem, nreclaim, nreclaimed);
+    release(&memlock);
+}
+
+// Print allocation sites holding pages, the most first.
+// Look the addresses up with addr2line -e obj/kernel.o.
+void
+kmem_site_stat()
+{
+    uint8_t done[NSITE];
+    memset(done, 0, sizeof(done));
+    while (1) {
+        int m = -1;
+        for (int i = 0; i < NSITE; i ++)
+            if (!done[i] && sites[i].npages > 0 && (m < 0 || sites[i].npages > sites[m].npages))
+                m = i;
+        if (m < 0)
+            break;
+        done[m] = 1;
+        cprintf("kmem: site 0x%x: %d pages, %d allocs\n",
+            m ? sites[m].pc : 0, sites[m].npages, sites[m].nalloc);
+    }
+}
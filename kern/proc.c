@@ -1,51 +1,367 @@
 #include <kern/inc.h>
 #include <inc/sys.h>
 
+#include <arch/i386/x86.h>
+
 struct ptable ptable;
+int quantum = QUANTUM;
+static struct mutex spawn_mutex;        // Serializes spawns
+static struct mutex stat_mutex;         // Keeps dumps from interleaving
+
+// Exited processes of each cpu, to be freed by its scheduler.
+// Only touched by that cpu with interrupts off, so no lock.
+static struct {
+    struct list_head procs;     // Linked by pos
+    uint32_t nreaped;
+} __attribute__((aligned(64))) zombies[NCPU];
+
+// Servers to be told when memory is low, under ptable.lock
+#define NMEMWATCH 8
+static int memwatch_pids[NMEMWATCH];
 
 void 
 proc_init()
 {
-    for (int i = 0; i < PROC_BUCKET_SIZE; i ++)
-        list_init(&ptable.hlist[i]);
-    list_init(&ptable.ready_list);
-    list_init(&ptable.zombie_list);
+    for (int i = 0; i < NPROC; i ++)
+        ptable.gen[i] = 1;
+    for (int i = 0; i < NCPU; i ++)
+        for (int j = 0; j < NPRIO; j ++)
+            list_init(&ptable.runq[i].procs[j]);
+    lock_init(&ptable.lock, "ptable");
+    for (int i = 0; i < NCPU; i ++)
+        list_init(&zombies[i].procs);
+    mutex_init(&spawn_mutex);
+    mutex_init(&stat_mutex);
 }
 
-// Free all zombie proc.
-// Caller should hold ptable.lock.
-void
-reapall()
+// Free the processes that exited on this cpu, in a batch and
+// without ptable.lock. Called by the scheduler with interrupts off,
+// once the processes are off their kernel stacks.
+static void
+reap_zombies()
 {
-    while(!list_empty(&ptable.zombie_list)) {
-        struct proc *zp = CONTAINER_OF(list_front(&ptable.zombie_list), struct proc, pos);
+    int c = cpuidx();
+    while (!list_empty(&zombies[c].procs)) {
+        struct proc *zp = CONTAINER_OF(list_front(&zombies[c].procs), struct proc, pos);
         list_drop(&zp->pos);
         reap(zp);
+        zombies[c].nreaped ++;
     }
 }
 
-// Scheduler routine
-void
+// Whether p may run on any cpu, and so be stolen
+static int
+proc_mobile(struct proc *p)
+{
+    uint32_t all = (1u << ncpu) - 1;
+    return (p->affinity & all) == all;
+}
+
+// Whether p may run on cpu c
+static int
+proc_allowed(struct proc *p, int c)
+{
+    return (p->affinity >> c) & 1;
+}
+
+// Make p runnable on the cpu it last ran on, or on this one if
+// that is busier at p's priority or p has never run, as long as
+// its affinity allows, else on the least busy cpu it may run on.
+// Woken processes go first in their class.
+// Caller should hold ptable.lock, as p may be sleeping.
+static void
+runq_add(struct proc *p, int front)
+{
+    int c = cpuidx(), pr = p->prio;
+    if (p->cpu >= 0 && proc_allowed(p, p->cpu) &&
+        (ptable.runq[p->cpu].n[pr] <= ptable.runq[c].n[pr] || !proc_allowed(p, c)))
+        c = p->cpu;
+    else if (!proc_allowed(p, c)) {
+        int best = -1;
+        for (int i = 0; i < ncpu; i ++)
+            if (proc_allowed(p, i) && (best < 0 || ptable.runq[i].n[pr] < ptable.runq[best].n[pr]))
+                best = i;
+        assert(best >= 0);
+        c = best;
+    }
+    struct runq *rq = &ptable.runq[c];
+    acquire(&rq->lock);
+    if (front)
+        list_push_front(&rq->procs[pr], &p->pos);
+    else
+        list_push_back(&rq->procs[pr], &p->pos);
+    rq->n[pr] ++;
+    if (proc_mobile(p))
+        rq->nmobile[pr] ++;
+    p->onrq = 1;
+    release(&rq->lock);
+
+    // Wake the cpu if halted. Else have it preempt what it runs
+    // if that is lower, by an IPI or, on this cpu, before trap
+    // returns to user, and wake one idle cpu to steal if it
+    // already had others waiting.
+    __sync_synchronize();
+    if (rq->idle || pr < PRIO_USER) {
+        if (c != cpuidx())
+            cpu_kick(c);
+        else if (pr < thisproc()->prio)
+            rq->resched = 1;
+    }
+    if (!rq->idle && rq->n[pr] > 1 && proc_mobile(p)) {
+        for (c = 0; c < ncpu && !ptable.runq[c].idle; c ++)
+            ;
+        if (c < ncpu && c != cpuidx())
+            cpu_kick(c);
+    }
+}
+
+// Take p off the run queue of cpu c. pos is left as it is,
+// not empty, so p does not look asleep to wakeup.
+// Caller should hold the lock of the run queue.
+static void
+runq_del(struct proc *p, int c)
+{
+    struct runq *rq = &ptable.runq[c];
+    list_drop(&p->pos);
+    assert(!list_empty(&p->pos));
+    rq->n[p->prio] --;
+    if (proc_mobile(p))
+        rq->nmobile[p->prio] --;
+    p->onrq = 0;
+}
+
+// Claim p to run on this cpu, waiting for it to be off the stack
+// of the cpu it last left, as it may queue itself before leaving.
+// It is claimed before it leaves its run queue, so a process with
+// neither oncpu nor onrq set stays so while ptable.lock is held.
+static void
+proc_claim(struct proc *p)
+{
+    while (p->oncpu)
+        pause();
+    p->oncpu = 1;
+}
+
+// Finish a switch on the new stack, once prev is off the old one.
+// Returns 1 if ptable.lock came along with the switch, or releases
+// the run queue lock sched held across it and returns 0.
+int
+swtch_done(struct proc *prev)
+{
+    struct runq *rq = &ptable.runq[cpuidx()];
+    struct spinlock *lk = rq->handoff;
+    prev->oncpu = 0;
+    if (!lk)
+        return 1;
+    rq->handoff = 0;
+    release(lk);
+    return 0;
+}
+
+// The highest priority runnable on cpu c, or NPRIO if none.
+// Only counts processes that may be stolen if mobile is set.
+static int
+runq_top(int c, int mobile)
+{
+    struct runq *rq = &ptable.runq[c];
+    int pr = 0;
+    while (pr < NPRIO && !(mobile ? rq->nmobile[pr] : rq->n[pr]))
+        pr ++;
+    return pr;
+}
+
+// The cpu to take the next process from, or -1 if there is none.
+// It is c unless another cpu has something of higher priority
+// that c may steal, else the one with most such processes at the
+// highest priority. May be called without the lock, as a hint.
+static int
+runq_pick(int c)
+{
+    int from = c, top = runq_top(c, 0);
+    for (int i = 0; i < ncpu; i ++) {
+        int t = runq_top(i, 1);
+        if (i == c || t == NPRIO || t > top)
+            continue;
+        if (t < top || (from != c && ptable.runq[i].nmobile[t] > ptable.runq[from].nmobile[t])) {
+            from = i;
+            top = t;
+        }
+    }
+    return top == NPRIO ? -1 : from;
+}
+
+// Scheduler routine, running the highest priority process around,
+// from this cpu's queue if it has one of that priority.
+// Only the run queue it comes from is locked, and the lock is
+// released by the process once switched to, see swtch_done.
+// Return 0 if there is nothing to run.
+int
 sched()
 {
+    int ran = 0, c = cpuidx();
+
+    // Idle cpus leave the locks alone
+    if (runq_pick(c) < 0 && !kmem_low())
+        return 0;
+
+    if (kmem_lowmem()) {
+        kmem_reclaim();
+        acquire(&ptable.lock);
+        memnotify();
+        release(&ptable.lock);
+    }
+    int from = runq_pick(c);
+    if (from >= 0) {
+        struct runq *rq = &ptable.runq[from];
+        struct proc *p;
+        acquire(&rq->lock);
+        // Others may have taken it since runq_pick
+        int pr = runq_top(from, from != c);
+        if (pr < NPRIO) {
+            LIST_FOREACH_ENTRY(p, &rq->procs[pr], pos)
+                if (from == c || proc_mobile(p))
+                    break;
+            proc_claim(p);
+            runq_del(p, from);
+            if (from != c)
+                ptable.runq[c].nsteal ++;
+            p->ticks = quantum;
+            ptable.runq[c].handoff = &rq->lock;
+            // Processes come back holding ptable.lock
+            if (swtch(p))
+                release(&ptable.lock);
+            ran = 1;
+        }
+        else
+            release(&rq->lock);
+    }
+    reap_zombies();
+    if (!ran && kmem_low())
+        swap_reclaim();
+    return ran;
+}
+
+// Halt this cpu until there may be something to run.
+// runq_add reads idle after queuing, so a process queued
+// once idle is set is seen here or gets this cpu kicked.
+// Called by the scheduler with interrupts off.
+void
+sched_idle()
+{
+    int c = cpuidx();
+    struct runq *rq = &ptable.runq[c];
+    rq->idle = 1;
+    __sync_synchronize();
+    if (runq_pick(c) < 0) {
+        rq->nhalt ++;
+        cpu_halt();
+    }
+    rq->idle = 0;
+}
+
+// Called on timer and reschedule interrupts from user mode, and
+// before returning to user if resched of this cpu is set.
+// Put this process back to its run queue if its time slice
+// ran out (expired) or something of higher priority is waiting
+// on this cpu.
+void
+sched_preempt(int expired)
+{
+    struct proc *tp = thisproc();
+    ptable.runq[cpuidx()].resched = 0;
+    if (tp == thisched())
+        return;
+    if (!expired && runq_top(cpuidx(), 0) >= tp->prio)
+        return;
     acquire(&ptable.lock);
-    if (!list_empty(&ptable.ready_list)) {
-        struct proc *p = CONTAINER_OF(list_front(&ptable.ready_list), struct proc, pos);
-        list_drop(&p->pos);
-        assert(!list_empty(&p->pos));
-        swtch(p);
+    tp->nivcsw ++;
+    runq_add(tp, 0);
+    if (swtch(thisched()))
+        release(&ptable.lock);
+}
+
+// Give up the cpu to processes of the same or higher priority,
+// going to the back of this process's class.
+void
+sched_yield()
+{
+    acquire(&ptable.lock);
+    runq_add(thisproc(), 0);
+    if (swtch(thisched()))
+        release(&ptable.lock);
+}
+
+// Let this process run only on the cpus in mask, bit i for cpu i,
+// moving it if this cpu is not one of them. Returns 0, or -1.
+int
+setaffinity(uint32_t mask)
+{
+    struct proc *tp = thisproc();
+    mask &= (1u << ncpu) - 1;
+    if (!mask)
+        return -1;
+    acquire(&ptable.lock);
+    tp->affinity = mask;
+    if (!proc_allowed(tp, cpuidx())) {
+        runq_add(tp, 0);
+        if (!swtch(thisched()))
+            return 0;
     }
-    else 
-        reapall();
     release(&ptable.lock);
+    return 0;
 }
 
-// Caller should hold ptable.lock
+static void
+msleep_expire(void *pid)
+{
+    acquire(&ptable.lock);
+    struct proc *p = pid2proc((int)pid);
+    if (p)
+        wakeup(p);
+    release(&ptable.lock);
+}
+
+// Sleep for ms milliseconds, off the run queues.
+// The timer is added under ptable.lock, so it cannot
+// wake this process before it sleeps. It is added again
+// until the deadline, as timer_add cuts long timeouts.
+void
+msleep(int ms)
+{
+    struct timer t;
+    uint32_t end = clock_ms() + ms;
+    int left = ms;
+    timer_init(&t, msleep_expire, (void *)thisproc()->pid);
+    acquire(&ptable.lock);
+    do {
+        timer_add(&t, left);
+        while (timer_pending(&t))
+            sleep();
+    } while ((left = end - clock_ms()) > 0);
+    release(&ptable.lock);
+}
+
+// Move this process to priority class prio, which may not be
+// higher than the class it was created in. Returns 0, or -1.
+int
+setprio(int prio)
+{
+    struct proc *tp = thisproc();
+    if (prio < tp->class || prio >= NPRIO)
+        return -1;
+    acquire(&ptable.lock);
+    tp->prio = prio;
+    release(&ptable.lock);
+    return 0;
+}
+
+// Caller should hold ptable.lock, which it holds again on return
 inline void
 sleep()
 {
     list_init(&thisproc()->pos);
-    swtch(thisched());
+    if (!swtch(thisched()))
+        acquire(&ptable.lock);
 }
 
 // Wake up process if it is sleeping
@@ -56,25 +372,32 @@ wakeup(struct proc *p)
 {
     if (PROC_EXISTS(p) && list_empty(&p->pos)) {
         assert(p != thisproc() && p != thisched());
-        list_push_front(&ptable.ready_list, &p->pos);
+        runq_add(p, 1);
     }
 }
 
 // Sleep and wait for process p.
-// Direct swtch if possible.
-// Caller should hold ptable.lock
+// Direct swtch if possible, handing ptable.lock over to p.
+// Caller should hold ptable.lock, which it holds again on return
 void
 yield(struct proc *p)
 {
     struct proc *tp = thisproc();
+    struct proc *to = thisched();
     assert(PROC_EXISTS(p));
     list_push_back(&p->wait_list, &tp->pos);
-    if (list_empty(&p->pos)) {
+    if (list_empty(&p->pos) && proc_allowed(p, cpuidx())) {
         p->pos.next = 0;
-        swtch(p);
+        p->ticks = quantum;
+        proc_claim(p);
+        to = p;
+    }
+    else if (list_empty(&p->pos)) {
+        // Wake it where it may run
+        runq_add(p, 1);
     }
-    else 
-        swtch(thisched());
+    if (!swtch(to))
+        acquire(&ptable.lock);
 }
 
 // Serve and return the first process in waiting list
@@ -91,42 +414,154 @@ serve()
     assert(PROC_EXISTS(p) && p != thisproc() && p != thisched());
 
     list_drop(&p->pos);
-    list_push_back(&ptable.ready_list, &p->pos);
+    runq_add(p, 0);
     return p;
 }
 
+// Give process p from proc_alloc a pid, not yet making it runnable.
+// Returns 0, or -1 if the process table is full.
+// Caller should hold ptable.lock.
+int
+proc_attach(struct proc *p)
+{
+    int i, s;
+    for (i = 0; i < NPROC; i ++) {
+        s = (ptable.nextslot + i) % NPROC;
+        if (!ptable.procs[s])
+            break;
+    }
+    if (i == NPROC)
+        return -1;
+    ptable.nextslot = (s + 1) % NPROC;
+    ptable.procs[s] = p;
+    p->pid = ptable.gen[s] << NPROC_BITS | s;
+    return 0;
+}
+
+// Make p, given a pid by proc_attach, runnable.
+// Caller should hold ptable.lock.
 void
-exit() 
+proc_run(struct proc *p)
+{
+    runq_add(p, 0);
+}
+
+// Give process p from proc_alloc a pid and make it runnable.
+// Returns 0, or -1 if the process table is full.
+// Caller should hold ptable.lock.
+int
+proc_start(struct proc *p)
+{
+    if (proc_attach(p))
+        return -1;
+    runq_add(p, 0);
+    return 0;
+}
+
+// The live process of pid, or 0.
+// Caller should hold ptable.lock.
+struct proc *
+pid2proc(int pid)
+{
+    struct proc *p = ptable.procs[PID_SLOT(pid)];
+    return p && p->pid == pid ? p : 0;
+}
+
+void
+mutex_init(struct mutex *m)
+{
+    m->owner = 0;
+    list_init(&m->waiters);
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+    struct proc *tp = thisproc();
+    acquire(&ptable.lock);
+    if (m->owner) {
+        // A scheduler has nothing to switch back to it
+        assert(m->owner != tp && tp != thisched());
+        list_push_back(&m->waiters, &tp->pos);
+        if (!swtch(thisched()))
+            acquire(&ptable.lock);
+        assert(m->owner == tp);
+    }
+    else
+        m->owner = tp;
+    release(&ptable.lock);
+}
+
+// Hand m to the first waiter, if any
+void
+mutex_unlock(struct mutex *m)
 {
     acquire(&ptable.lock);
+    assert(m->owner == thisproc());
+    m->owner = 0;
+    if (!list_empty(&m->waiters)) {
+        struct proc *p = CONTAINER_OF(list_front(&m->waiters), struct proc, pos);
+        list_drop(&p->pos);
+        m->owner = p;
+        runq_add(p, 0);
+    }
+    release(&ptable.lock);
+}
+
+void
+exit() 
+{
     struct proc *tp = thisproc();
+    cprintf("exit: proc 0x%x exit.\n", tp);
+
+    acquire(&ptable.lock);
     assert(PROC_EXISTS(tp));
 
+    // No one can find it from now on
+    int s = PID_SLOT(tp->pid);
+    ptable.procs[s] = 0;
+    ptable.gen[s] = ptable.gen[s] % (PID_GEN_MAX - 1) + 1;
+    for (int i = 0; i < NMEMWATCH; i ++)
+        if (memwatch_pids[i] == tp->pid)
+            memwatch_pids[i] = 0;
+
     // Wakeup waiters
-    struct proc *wp;
-    LIST_FOREACH_ENTRY(wp, &tp->wait_list, pos) {
-        // FIXME
-        wakeup(wp);
+    while (!list_empty(&tp->wait_list)) {
+        struct proc *wp = CONTAINER_OF(list_front(&tp->wait_list), struct proc, pos);
+        list_drop(&wp->pos);
+        runq_add(wp, 0);
     }
-    cprintf("exit: proc 0x%x exit.\n", tp);
-
-    list_drop(&tp->hlist);
-    list_push_back(&ptable.zombie_list, &tp->pos);
+    release(&ptable.lock);
 
-    proc_stat();
+    // Free user memory without holding up other cpus,
+    // flushing what is left of it in the TLB
+    vm_clear(tp->vm);
+    vm_switch(tp->vm);
 
+    // The scheduler of this cpu frees the rest once off its stack
+    acquire(&ptable.lock);
+    list_push_back(&zombies[cpuidx()].procs, &tp->pos);
     swtch(thisched());
     panic("exit: return\n");
 }
 
+// Grow or shrink the heap of this process by n bytes.
+// Returns the old break, or -1 if out of memory.
 void *
 sbrk(int n)
 {
     struct proc *tp = thisproc();
     int sz = tp->size;
     assert(sz >= 0);
-    if (n > 0) 
-        vm_alloc(tp->vm, USTKTOP + PGSIZE + sz, n);// PGSIZE for mailbox
+    if (n > 0) {
+        uint32_t brk = USTKTOP + PGSIZE + sz;// PGSIZE for mailbox
+        if (vm_alloc(tp->vm, brk, n) < 0) {
+            uint32_t s = ROUNDUP(brk, PGSIZE);
+            if (s < brk + n)
+                vm_dealloc(tp->vm, s, brk + n - s);
+            return (void *)-1;
+        }
+    }
     else if (n < 0) {
         if (sz + n < 0) 
             n = -sz;
@@ -138,41 +573,101 @@ sbrk(int n)
     return (void *)USTKTOP+PGSIZE+sz;
 }
 
-struct proc *
-spawn(struct elfhdr *elf)
+// Register this process to get SIG_SHRINK in its mailbox
+// when memory is low. Returns 0, or -1 if too many are registered.
+int
+memwatch()
 {
+    int ret = -1;
     acquire(&ptable.lock);
-    struct proc *p = spawnx(elf, 0);
+    for (int i = 0; i < NMEMWATCH && ret; i ++) {
+        if (!memwatch_pids[i] || memwatch_pids[i] == thisproc()->pid) {
+            memwatch_pids[i] = thisproc()->pid;
+            ret = 0;
+        }
+    }
     release(&ptable.lock);
+    return ret;
+}
+
+// Ask registered servers to give memory back.
+// Caller should hold ptable.lock.
+void
+memnotify()
+{
+    for (int i = 0; i < NMEMWATCH; i ++) {
+        struct proc *p = pid2proc(memwatch_pids[i]);
+        if (p) {
+            bitmap_set(p->mailbox->irq, SIG_SHRINK, 1);
+            wakeup(p);
+        }
+    }
+}
+
+// Load elf with no spinlock held, which may take a while
+struct proc *
+spawn(struct elfhdr *elf, int driver)
+{
+    mutex_lock(&spawn_mutex);
+    struct proc *p = spawnx(elf, driver);
+    if (p) {
+        acquire(&ptable.lock);
+        int err = proc_start(p);
+        release(&ptable.lock);
+        if (err) {
+            reap(p);
+            p = 0;
+        }
+    }
+    mutex_unlock(&spawn_mutex);
     return p;
 }
 
+// Print the process lists, snapshotted under ptable.lock
+// and printed after it is released.
+#define NPROCSTAT 16
 void
 proc_stat()
 {
     struct proc *p;
-    cprintf("ready_list: ");
-    LIST_FOREACH_ENTRY(p, &ptable.ready_list, pos) {
-        assert(PROC_EXISTS(p));
-        cprintf("0x%x", p);
-        if (!list_empty(&p->wait_list)) {
-            cprintf("(");
-            struct proc *wp;
-            LIST_FOREACH_ENTRY(wp, &p->wait_list, pos) {
-                cprintf("0x%x, ", p);
+    int nready = 0, nlive = 0, cpu[NPROCSTAT], prio[NPROCSTAT];
+    int pid[NPROCSTAT], ready[NPROCSTAT];
+    uint32_t nsteal[NCPU], nhalt[NCPU], nivcsw[NPROCSTAT];
+
+    mutex_lock(&stat_mutex);
+    acquire(&ptable.lock);
+    for (int i = 0; i < NPROC && nlive < NPROCSTAT; i ++) {
+        if ((p = ptable.procs[i])) {
+            nivcsw[nlive] = p->nivcsw;
+            prio[nlive] = p->prio;
+            pid[nlive++] = p->pid;
+        }
+    }
+    for (int i = 0; i < ncpu; i ++) {
+        acquire(&ptable.runq[i].lock);
+        for (int j = 0; j < NPRIO; j ++) {
+            LIST_FOREACH_ENTRY(p, &ptable.runq[i].procs[j], pos) {
+                if (nready < NPROCSTAT) {
+                    cpu[nready] = i;
+                    ready[nready++] = p->pid;
+                }
             }
-            cprintf(")");
         }
-        cprintf(", ");
+        release(&ptable.runq[i].lock);
+        nsteal[i] = ptable.runq[i].nsteal;
+        nhalt[i] = ptable.runq[i].nhalt;
     }
+    release(&ptable.lock);
+
+    cprintf("procs: ");
+    for (int i = 0; i < nlive; i ++)
+        cprintf("%d prio %d preempted %d, ", pid[i], prio[i], nivcsw[i]);
     cprintf("\n");
-    cprintf("zombie_list: ");
-    LIST_FOREACH_ENTRY(p, &ptable.zombie_list, pos) {
-        cprintf("0x%x, ", p);
-        assert(!PROC_EXISTS(p));
-        assert(p->magic == PROC_MAGIC);
-        assert(list_empty(&p->wait_list));
-    }
+    cprintf("runq: ");
+    for (int i = 0; i < nready; i ++)
+        cprintf("%d on %d, ", ready[i], cpu[i]);
     cprintf("\n");
+    for (int i = 0; i < ncpu; i ++)
+        cprintf("cpu %d: %d steals, %d halts, %d reaped\n", i, nsteal[i], nhalt[i], zombies[i].nreaped);
+    mutex_unlock(&stat_mutex);
 }
-
@@ -0,0 +1,264 @@
+// Slab allocator for fixed-size kernel objects, on top of kalloc.
+//
+// Objects are kept constructed: ctor runs once when an object is
+// created, and kmem_cache_free expects the object back in its
+// constructed state. E.g. a page table is returned with all entries
+// cleared, so it can be reused without zeroing it again.
+//
+// Each cpu caches up to KMC_CPU_SIZE free objects of a cache and
+// moves KMC_BATCH of them at a time from and to the shared layer,
+// which is guarded by the cache's lock.
+//  - Small objects are packed into one-page slabs, with a stack of
+//    free object indices right behind the slab header.
+//  - Large objects are individual kalloc blocks.
+#include <inc/string.h>
+#include <kern/inc.h>
+
+#define KMC_MAX      16             // Maximum number of caches
+#define KMC_CPU_SIZE 16             // Objects cached per cpu
+#define KMC_BATCH    8              // Objects moved at once to and from a cpu
+#define SLAB_SMALL   (PGSIZE / 4)   // Larger objects are not packed
+
+struct slab {
+    struct list_head link;      // In partial or full list of its cache
+    char *objs;                 // The first object
+    int inuse;                  // Number of objects not in free[]
+    uint8_t free[];             // Stack of free object indices
+};
+
+// Taken by its cpu, and tried by slab_shrink from any cpu
+struct kmem_cpu_cache {
+    struct spinlock lock;
+    int cnt;
+    void *objs[KMC_CPU_SIZE];
+};
+
+struct kmem_cache {
+    char *name;
+    size_t size;
+    int flags;
+    void (*ctor)(void *);
+    int perslab;                // Objects per slab, 0 for large objects
+
+    struct spinlock lock;
+    struct list_head partial;   // Slabs with free objects
+    struct list_head full;      // Slabs without
+    int nslabs;                 // Slabs, or large objects, created
+    int nactive;                // Objects handed out to cpus
+
+    struct kmem_cpu_cache cpu[NCPU];
+};
+
+static struct kmem_cache caches[KMC_MAX];
+static int ncaches;
+static struct spinlock cachelock;
+static struct shrinker slab_shrinker;
+
+void
+kmem_cache_init()
+{
+    register_shrinker(&slab_shrinker);
+}
+
+// Create a cache of objects of sz bytes, each initialized by ctor
+// (if not null) once when it is created.
+struct kmem_cache *
+kmem_cache_create(char *name, size_t sz, int flags, void (*ctor)(void *))
+{
+    acquire(&cachelock);
+    assert(ncaches < KMC_MAX);
+    struct kmem_cache *c = &caches[ncaches++];
+    release(&cachelock);
+
+    c->name = name;
+    c->size = ROUNDUP(sz, sizeof(int));
+    c->flags = flags;
+    c->ctor = ctor;
+    assert(!(flags & KMC_ZERO) || c->size <= PGSIZE);
+    if (c->size <= SLAB_SMALL) {
+        c->perslab = (PGSIZE - sizeof(struct slab) - sizeof(int)) / (c->size + 1);
+        c->perslab = MIN(c->perslab, 255);
+    }
+    list_init(&c->partial);
+    list_init(&c->full);
+    lock_init(&c->lock, name);
+    return c;
+}
+
+// Allocate and construct a new slab.
+// Caller should hold c->lock.
+static struct slab *
+slab_grow(struct kmem_cache *c)
+{
+    struct slab *s = (c->flags & KMC_ZERO) ? kalloc_zero() : kalloc(PGSIZE);
+    if (!s)
+        return 0;
+    s->objs = ROUNDUP((char *)(s->free + c->perslab), sizeof(int));
+    s->inuse = 0;
+    for (int i = 0; i < c->perslab; i ++) {
+        s->free[i] = c->perslab - 1 - i;
+        if (c->ctor)
+            c->ctor(s->objs + i * c->size);
+    }
+    list_push_front(&c->partial, &s->link);
+    c->nslabs ++;
+    return s;
+}
+
+// Take one object from the shared layer.
+// Caller should hold c->lock.
+static void *
+slab_get(struct kmem_cache *c)
+{
+    struct slab *s;
+    void *obj;
+
+    if (!c->perslab) {
+        obj = (c->flags & KMC_ZERO) ? kalloc_zero() : kalloc(c->size);
+        if (obj) {
+            if (c->ctor)
+                c->ctor(obj);
+            c->nslabs ++;
+        }
+        return obj;
+    }
+
+    if (list_empty(&c->partial) && !slab_grow(c))
+        return 0;
+    s = CONTAINER_OF(list_front(&c->partial), struct slab, link);
+    obj = s->objs + s->free[c->perslab - 1 - s->inuse] * c->size;
+    if (++s->inuse == c->perslab) {
+        list_drop(&s->link);
+        list_push_front(&c->full, &s->link);
+    }
+    return obj;
+}
+
+// Return one object to the shared layer, freeing its slab
+// if the slab becomes empty and is not the only partial one.
+// Caller should hold c->lock.
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+    if (!c->perslab) {
+        kfree(obj);
+        c->nslabs --;
+        return;
+    }
+
+    struct slab *s = ROUNDDOWN(obj, PGSIZE);
+    s->free[c->perslab - s->inuse--] = ((char *)obj - s->objs) / c->size;
+    list_drop(&s->link);
+    if (!s->inuse && !list_empty(&c->partial)) {
+        kfree(s);
+        c->nslabs --;
+    }
+    else
+        list_push_front(&c->partial, &s->link);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    pushcli();
+    struct kmem_cpu_cache *cc = &c->cpu[cpuidx()];
+    acquire(&cc->lock);
+    if (!cc->cnt) {
+        acquire(&c->lock);
+        while (cc->cnt < KMC_BATCH && (cc->objs[cc->cnt] = slab_get(c)))
+            cc->cnt ++;
+        c->nactive += cc->cnt;
+        release(&c->lock);
+    }
+    void *obj = cc->cnt ? cc->objs[--cc->cnt] : 0;
+    release(&cc->lock);
+    popcli();
+    return obj;
+}
+
+// Free obj, which should be in its constructed state.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    pushcli();
+    struct kmem_cpu_cache *cc = &c->cpu[cpuidx()];
+    acquire(&cc->lock);
+    if (cc->cnt == KMC_CPU_SIZE) {
+        acquire(&c->lock);
+        for (int i = 0; i < KMC_BATCH; i ++)
+            slab_put(c, cc->objs[i]);
+        c->nactive -= KMC_BATCH;
+        release(&c->lock);
+        memmove(cc->objs, cc->objs + KMC_BATCH, (KMC_CPU_SIZE - KMC_BATCH) * sizeof(void *));
+        cc->cnt -= KMC_BATCH;
+    }
+    cc->objs[cc->cnt++] = obj;
+    release(&cc->lock);
+    popcli();
+}
+
+// Pages taken by a slab, or a large object, of c
+static int
+slab_pages(struct kmem_cache *c)
+{
+    int n = 1;
+    while (!c->perslab && n * PGSIZE < c->size)
+        n <<= 1;
+    return n;
+}
+
+// Give back the objects cached by cpus and the empty slabs of all
+// caches. Locks are only tried, as kalloc may be called with them
+// held, e.g. by slab_grow, and busy caches are skipped.
+static int
+slab_shrink()
+{
+    int n = 0;
+    for (struct kmem_cache *c = caches; c < caches + ncaches; c ++) {
+        for (int i = 0; i < ncpu; i ++) {
+            struct kmem_cpu_cache *cc = &c->cpu[i];
+            if (!cc->cnt || !spin_tryacquire(&cc->lock))
+                continue;
+            if (spin_tryacquire(&c->lock)) {
+                int nslabs = c->nslabs;
+                for (int j = 0; j < cc->cnt; j ++)
+                    slab_put(c, cc->objs[j]);
+                c->nactive -= cc->cnt;
+                cc->cnt = 0;
+                n += (nslabs - c->nslabs) * slab_pages(c);
+                release(&c->lock);
+            }
+            release(&cc->lock);
+        }
+
+        // slab_put keeps one empty slab around
+        if (!c->perslab || !spin_tryacquire(&c->lock))
+            continue;
+        struct list_head *l = c->partial.next;
+        while (l != &c->partial) {
+            struct slab *s = CONTAINER_OF(l, struct slab, link);
+            l = l->next;
+            if (!s->inuse) {
+                list_drop(&s->link);
+                kfree(s);
+                c->nslabs --;
+                n ++;
+            }
+        }
+        release(&c->lock);
+    }
+    return n;
+}
+
+static struct shrinker slab_shrinker = { .shrink = slab_shrink };
+
+void
+kmem_cache_stat()
+{
+    for (struct kmem_cache *c = caches; c < caches + ncaches; c ++) {
+        acquire(&c->lock);
+        cprintf("slab: %s: size %d, %d per slab, %d slabs, %d objs out\n",
+            c->name, c->size, c->perslab, c->nslabs, c->nactive);
+        release(&c->lock);
+    }
+}
@@ -3,18 +3,143 @@
 #include <arch/i386/x86.h>
 #include <arch/i386/mmu.h>
 
+// Named locks, see lock_init
+static struct lockstat *lockstats[NLOCKSTAT];
+static int nlockstat;
+
+void
+lockstat_init(struct lockstat *s, char *name)
+{
+    int i = __sync_fetch_and_add(&nlockstat, 1);
+    assert(i < NLOCKSTAT);
+    lockstats[i] = s;
+    s->name = name;
+}
+
+// Account an acquisition that started waiting at t0 if contended.
+// Caller should hold the lock.
+static inline void
+lockstat_acquired(struct lockstat *s, uint64_t t0, int contended, void *eip)
+{
+    uint64_t t = rdtsc();
+    s->nacq ++;
+    if (contended) {
+        uint32_t c = t - t0;
+        s->ncontend ++;
+        s->spin += c;
+        s->spin_max = MAX(s->spin_max, c);
+    }
+    s->tacq = t;
+    s->eip = eip;
+}
+
+// Caller should hold the lock.
+static inline void
+lockstat_released(struct lockstat *s)
+{
+    uint32_t c = rdtsc() - s->tacq;
+    s->hold += c;
+    s->hold_max = MAX(s->hold_max, c);
+}
+
+// Print the statistics of named locks to the console.
+// They are read without the locks, so they may be a bit off.
+void
+lockstat_dump()
+{
+    for (int i = 0; i < nlockstat; i ++) {
+        struct lockstat *s = lockstats[i];
+        cprintf("lock: %s: acquired %d, contended %d", s->name, s->nacq, s->ncontend);
+        if (s->ncontend)
+            cprintf(", spin avg %d max %d", divl(s->spin, s->ncontend), s->spin_max);
+        if (s->nacq)
+            cprintf(", hold avg %d max %d", divl(s->hold, s->nacq), s->hold_max);
+        cprintf(", last eip 0x%x\n", s->eip);
+    }
+}
+
+// Ticket lock: take a ticket and wait for it to be served,
+// so cpus get the lock in the order they asked for it.
+// Interrupts are off while a lock is held.
 void 
-acquire(struct spinlock *lk) {
-    while(lk->locked || __sync_lock_test_and_set(&lk->locked, 1))
-        ;
+spin_acquire(struct spinlock *lk) {
+    pushcli();
+    uint16_t t = __sync_fetch_and_add(&lk->next, 1);
+    int contended = lk->owner != t;
+    uint64_t t0 = lk->stat.name && contended ? rdtsc() : 0;
+    while (lk->owner != t)
+        pause();
     assert(!(read_eflags()&FL_IF));
+    if (lk->stat.name)
+        lockstat_acquired(&lk->stat, t0, contended, __builtin_return_address(0));
+}
+
+// Take lk only if it is free, for callers that may not wait,
+// e.g. as they may run with lk held. Returns 1 if taken, else 0.
+int
+spin_tryacquire(struct spinlock *lk)
+{
+    pushcli();
+    uint16_t t = lk->owner;
+    if (lk->next != t || !__sync_bool_compare_and_swap(&lk->next, t, (uint16_t)(t + 1))) {
+        popcli();
+        return 0;
+    }
+    if (lk->stat.name)
+        lockstat_acquired(&lk->stat, 0, 0, __builtin_return_address(0));
+    return 1;
 }
 
 void 
-release(struct spinlock *lk) {
+spin_release(struct spinlock *lk) {
     assert(!(read_eflags()&FL_IF));
-    if (!lk->locked)
+    if (lk->next == lk->owner)
         panic("release: not locked\n");
-    __sync_lock_test_and_set(&lk->locked, 0);
+    if (lk->stat.name)
+        lockstat_released(&lk->stat);
+    asm volatile("" ::: "memory");
+    lk->owner ++;
+    popcli();
+}
+
+// MCS lock: queue up behind the tail and spin on our own node,
+// which the previous holder clears when it releases the lock.
+// Each cpu has its node in the lock, so the lock must be released
+// on the cpu that acquired it.
+void
+mcs_acquire(struct mcslock *lk)
+{
+    pushcli();
+    struct mcsnode *n = &lk->node[cpuidx()], *prev;
+    uint64_t t0 = lk->stat.name ? rdtsc() : 0;
+    n->next = 0;
+    n->locked = 1;
+    int contended = (prev = __sync_lock_test_and_set(&lk->tail, n)) != 0;
+    if (contended) {
+        prev->next = n;
+        while (n->locked)
+            pause();
+    }
+    assert(!(read_eflags()&FL_IF));
+    if (lk->stat.name)
+        lockstat_acquired(&lk->stat, t0, contended, __builtin_return_address(0));
 }
 
+void
+mcs_release(struct mcslock *lk)
+{
+    struct mcsnode *n = &lk->node[cpuidx()];
+    assert(!(read_eflags()&FL_IF));
+    if (!lk->tail)
+        panic("release: not locked\n");
+    if (lk->stat.name)
+        lockstat_released(&lk->stat);
+    if (n->next || !__sync_bool_compare_and_swap(&lk->tail, n, 0)) {
+        // A successor may be still linking itself in
+        while (!n->next)
+            pause();
+        asm volatile("" ::: "memory");
+        n->next->locked = 0;
+    }
+    popcli();
+}
@@ -0,0 +1,223 @@
+// Kernel timers on a hierarchical timing wheel per cpu.
+//
+// A timer is kept on the wheel of the cpu that added it, in a slot
+// of the level that covers how far away it is: level l has
+// WHEEL_SIZE slots of WHEEL_SIZE^l ticks each. When the lower levels
+// wrap around, the next slot of the level above is cascaded down,
+// so adding and removing a timer are O(1) and each timer is moved
+// at most WHEEL_LEVELS - 1 times.
+//
+// The wheel is driven by the one-shot LAPIC timer, which timer_arm
+// sets for the earlier of the next timer and the end of the running
+// time slice, so a cpu with neither takes no timer interrupts.
+#include <kern/inc.h>
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   (1u << (WHEEL_BITS * WHEEL_LEVELS))    // Farthest timer in ticks
+
+struct wheel {
+    struct spinlock lock;
+    struct list_head slot[WHEEL_LEVELS][WHEEL_SIZE];
+    uint32_t now;               // Last tick run
+    int n;                      // Pending timers
+    uint32_t slice_end;         // When the time slice ends, 0 if none
+} __attribute__((aligned(64)));
+
+static struct wheel wheels[NCPU];
+
+// Ticks since boot
+static uint32_t
+tick_now()
+{
+    return clock_ms() / TICK_MS;
+}
+
+void
+timer_wheel_init()
+{
+    uint32_t now = tick_now();
+    for (int i = 0; i < NCPU; i ++) {
+        struct wheel *w = &wheels[i];
+        for (int l = 0; l < WHEEL_LEVELS; l ++)
+            for (int j = 0; j < WHEEL_SIZE; j ++)
+                list_init(&w->slot[l][j]);
+        w->now = now;
+    }
+}
+
+void
+timer_init(struct timer *t, void (*fn)(void *), void *arg)
+{
+    list_init(&t->link);
+    t->fn = fn;
+    t->arg = arg;
+    t->cpu = -1;
+}
+
+// Put t in the slot of w it is due in.
+// Caller should hold w->lock, and t->expires should not be before w->now.
+static void
+wheel_insert(struct wheel *w, struct timer *t)
+{
+    uint32_t d = t->expires - w->now;
+    int l = 0;
+    while (l < WHEEL_LEVELS - 1 && d >= (1u << (WHEEL_BITS * (l + 1))))
+        l ++;
+    list_push_back(&w->slot[l][(t->expires >> (WHEEL_BITS * l)) & WHEEL_MASK], &t->link);
+}
+
+// The first tick on which a slot of w may have something due,
+// or 0 if w is empty.
+// Caller should hold w->lock.
+static uint32_t
+wheel_next(struct wheel *w)
+{
+    uint32_t next = 0;
+    if (!w->n)
+        return 0;
+    for (int l = 0; l < WHEEL_LEVELS; l ++) {
+        uint32_t cur = w->now >> (WHEEL_BITS * l);
+        for (int k = 1; k <= WHEEL_SIZE; k ++) {
+            if (!list_empty(&w->slot[l][(cur + k) & WHEEL_MASK])) {
+                uint32_t t = (cur + k) << (WHEEL_BITS * l);
+                if (!next || (int32_t)(t - next) < 0)
+                    next = t;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+// Arm the timer of this cpu for the next deadline of w.
+// Caller should hold w->lock.
+static void
+wheel_arm(struct wheel *w)
+{
+    uint32_t next = wheel_next(w), now = tick_now();
+    if (w->slice_end && (!next || (int32_t)(w->slice_end - next) < 0))
+        next = w->slice_end;
+    if (!next)
+        lapic_timer(0);
+    else
+        lapic_timer((int32_t)(next - now) > 0 ? next - now : 1);
+}
+
+// Run t->fn(t->arg) in ms milliseconds, on the timer interrupt
+// of this cpu. t should not be pending. Timeouts beyond half the
+// span of the wheel, WHEEL_SPAN / 2 ticks, run early at its end,
+// and callers needing more should add t again.
+void
+timer_add(struct timer *t, int ms)
+{
+    pushcli();
+    struct wheel *w = &wheels[cpuidx()];
+    uint32_t d = (MAX(ms, 0) + TICK_MS - 1) / TICK_MS;
+    uint32_t now = tick_now();
+    acquire(&w->lock);
+    assert(t->cpu < 0);
+    if (!w->n)
+        w->now = now;
+    if ((int32_t)(now - w->now) < 0)
+        now = w->now;
+    t->expires = now + MIN(MAX(d, 1), WHEEL_SPAN / 2);
+    t->cpu = cpuidx();
+    w->n ++;
+    wheel_insert(w, t);
+    wheel_arm(w);
+    release(&w->lock);
+    popcli();
+}
+
+// Cancel t. Returns 1 if it was pending, or 0 if it already ran
+// or is running.
+int
+timer_del(struct timer *t)
+{
+    int c = t->cpu;
+    if (c < 0)
+        return 0;
+    struct wheel *w = &wheels[c];
+    acquire(&w->lock);
+    int pending = t->cpu == c;
+    if (pending) {
+        list_drop(&t->link);
+        t->cpu = -1;
+        w->n --;
+    }
+    release(&w->lock);
+    return pending;
+}
+
+int
+timer_pending(struct timer *t)
+{
+    return t->cpu >= 0;
+}
+
+// Arm the timer of this cpu for its next timer, or the end of
+// a time slice of slice ticks from now if that is earlier.
+// Called with interrupts off when switching processes.
+void
+timer_arm(int slice)
+{
+    struct wheel *w = &wheels[cpuidx()];
+    acquire(&w->lock);
+    w->slice_end = slice ? tick_now() + slice : 0;
+    wheel_arm(w);
+    release(&w->lock);
+}
+
+// Run the timers of this cpu that are due, on its timer interrupt.
+// Returns 1 if the time slice is over, which is then extended by
+// a tick for the caller to preempt the process in time.
+int
+timer_intr()
+{
+    struct wheel *w = &wheels[cpuidx()];
+    uint32_t now = tick_now();
+    acquire(&w->lock);
+    if (!w->n)
+        w->now = now;
+    while ((int32_t)(now - w->now) > 0) {
+        w->now ++;
+
+        // Cascade the levels whose lower ones wrapped
+        for (int l = 1; l < WHEEL_LEVELS; l ++) {
+            if (w->now & ((1u << (WHEEL_BITS * l)) - 1))
+                break;
+            struct list_head *s = &w->slot[l][(w->now >> (WHEEL_BITS * l)) & WHEEL_MASK];
+            while (!list_empty(s)) {
+                struct timer *t = CONTAINER_OF(list_front(s), struct timer, link);
+                list_drop(&t->link);
+                wheel_insert(w, t);
+            }
+        }
+
+        struct list_head *s = &w->slot[0][w->now & WHEEL_MASK];
+        while (!list_empty(s)) {
+            struct timer *t = CONTAINER_OF(list_front(s), struct timer, link);
+            void (*fn)(void *) = t->fn;
+            void *arg = t->arg;
+            list_drop(&t->link);
+            t->cpu = -1;
+            w->n --;
+            // t may be gone once it is not pending
+            release(&w->lock);
+            fn(arg);
+            acquire(&w->lock);
+        }
+        if (!w->n)
+            w->now = now;
+    }
+
+    int over = w->slice_end && (int32_t)(now - w->slice_end) >= 0;
+    if (over)
+        w->slice_end = now + 1;
+    wheel_arm(w);
+    release(&w->lock);
+    return over;
+}
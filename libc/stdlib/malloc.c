@@ -47,10 +47,10 @@ struct block_meta *request_space(struct block_meta* last, size_t size) {
   struct block_meta *block;
   block = sbrk(0);
   void *request = sbrk(size + META_SIZE);
-  assert((void*)block == request); // Not thread safe.
   if (request == (void*) -1) {
     return 0; // sbrk failed.
   }
+  assert((void*)block == request); // Not thread safe.
   
   if (last) { // 0 on first request.
     last->next = block;
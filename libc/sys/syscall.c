@@ -40,9 +40,16 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 
 void exit() { syscall(SYS_exit, 0, 0, 0, 0, 0, 0); }
 int fork() { return syscall(SYS_fork, 0, 0, 0, 0, 0, 0); }
-int sleep() { return syscall(SYS_sleep, 0, 0, 0, 0, 0, 0); }
+int sleep(int ms) { return syscall(SYS_sleep, 0, ms, 0, 0, 0, 0); }
 int yield() { return syscall(SYS_yield, 0, 0, 0, 0, 0, 0); }
 void *sbrk(int n) { return (void *)syscall(SYS_sbrk, 0, n, 0, 0, 0, 0); }
+int memwatch() { return syscall(SYS_memwatch, 0, 0, 0, 0, 0, 0); }
+int dmalloc(void *va, int n) { return syscall(SYS_dmalloc, 0, (uint32_t)va, n, 0, 0, 0); }
+int quantum(int ticks) { return syscall(SYS_quantum, 0, ticks, 0, 0, 0, 0); }
+int setprio(int prio) { return syscall(SYS_setprio, 0, prio, 0, 0, 0, 0); }
+int setaffinity(unsigned mask) { return syscall(SYS_setaffinity, 0, mask, 0, 0, 0, 0); }
+uint64_t clock_ns() { uint64_t ns = 0; syscall(SYS_clock, 0, (uint32_t)&ns, 0, 0, 0, 0); return ns; }
+int kstat(int what) { return syscall(SYS_kstat, 0, what, 0, 0, 0, 0); }
 
 int
 sys_send(int pid, int cnt) {
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <types.h>
+#include <unistd.h>
+#include <syscall.h>
+
+extern int32_t syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+
+void
+test_clock()
+{
+    cprintf("##### test clock begin\n");
+
+    // Never going back
+    uint64_t t0 = clock_ns(), t1 = t0;
+    for (int i = 0; i < 1000; i ++) {
+        uint64_t t = clock_ns();
+        assert(t >= t1);
+        t1 = t;
+    }
+    cprintf("test_clock: 1000 reads in %d ns\n", (uint32_t)(t1 - t0));
+
+    // Sleeping takes at least as long as asked
+    int ms[] = {10, 50, 200};
+    for (int i = 0; i < 3; i ++) {
+        t0 = clock_ns();
+        assert(sleep(ms[i]) == 0);
+        uint32_t elapsed = (t1 = clock_ns()) / 1000000 - t0 / 1000000;
+        cprintf("test_clock: sleep(%d) took %d ms\n", ms[i], elapsed);
+        assert(t1 - t0 >= (uint64_t)ms[i] * 1000000);
+    }
+
+    // Bad pointers are refused rather than faulted on
+    assert(syscall(SYS_clock, 0, 0x10000000, 0, 0, 0, 0) == -1);
+    assert(syscall(SYS_clock, 0, 0xF0000000, 0, 0, 0, 0) == -1);
+    cprintf("##### test clock end\n");
+}
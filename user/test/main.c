@@ -2,12 +2,18 @@
 extern void test_fork();
 extern void test_ipc();
 extern void test_malloc();
+extern void test_clock();
+extern void test_sched();
+extern void test_mem();
 
 void
 umain(int argc, char **argv) 
 {
     //test_fork();
-    test_ipc();
+    //test_ipc();
     test_malloc();
+    test_clock();
+    test_sched();
+    test_mem();
 }
 
@@ -0,0 +1,16 @@
+#include <stdio.h>
+#include <unistd.h>
+
+void
+test_mem()
+{
+    cprintf("##### test mem begin\n");
+
+    // Registering twice takes one slot
+    assert(memwatch() == 0);
+    assert(memwatch() == 0);
+
+    // DMA buffers are for drivers
+    assert(dmalloc((void *)0x10000000, 1) == -1);
+    cprintf("##### test mem end\n");
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys.h>
+
+void
+test_sched()
+{
+    cprintf("##### test sched begin\n");
+
+    // Time slices are for drivers to set
+    assert(quantum(5) == -1);
+    assert(quantum(0) == -1);
+
+    // Users may not go above their class
+    assert(setprio(PRIO_DRIVER) == -1);
+    assert(setprio(PRIO_SERVER) == -1);
+    assert(setprio(NPRIO) == -1);
+    assert(setprio(PRIO_USER) == 0);
+
+    // Pinned to cpu 0, then back to all of them
+    assert(setaffinity(0) == -1);
+    assert(setaffinity(1) == 0);
+    for (int i = 0; i < 10; i ++)
+        assert(yield() == 0);
+    assert(setaffinity(~0u) == 0);
+    cprintf("##### test sched end\n");
+}